@@ -1,10 +1,18 @@
 #include <iostream>
 #include <cmath>
 #include <vector>
-#include <list>
 #include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
 #include "tgaimage.cpp"
 #include "geometry.h"
+#include "parallel.h"
+#include "obj_parser.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAST_SSE
+#endif
 
 using namespace std;
 
@@ -15,194 +23,817 @@ const TGAColor white = TGAColor(255, 255, 255, 255);
 const TGAColor red   = TGAColor(255, 0, 0, 255);
 const TGAColor blue  = TGAColor(0, 0, 255, 255);
 
-vector<float> z(width*height, 0);
-int contour[height][2]; //min max
+// z-spremnik, manja dubina je bliza; uz njega grubi hijerarhijski z s najvecom i najmanjom
+// dubinom svake 8x8 plocice, pa se plocica koju trokut ne moze probiti preskace cijela.
+// Redci su poravnati na cijele plocice da se redak bloka moze citati odjednom
+struct DepthBuffer {
+  static const int tile = 8;
+  int w, h, tiles_x, tiles_y, stride;
+  vector<float> z;
+  vector<float> tile_max, tile_min;
+  DepthBuffer(int w, int h): w(w), h(h), tiles_x((w + tile - 1)/tile), tiles_y((h + tile - 1)/tile), stride(tiles_x*tile) {
+    clear();
+  }
+  void clear() {
+    z.assign(stride*tiles_y*tile, numeric_limits<float>::max());
+    tile_max.assign(tiles_x*tiles_y, numeric_limits<float>::max());
+    tile_min.assign(tiles_x*tiles_y, numeric_limits<float>::max());
+  }
+  float& at(int x, int y) { return z[x + y*stride]; }
+  float& coarse(int tx, int ty) { return tile_max[tx + ty*tiles_x]; }
+  float& coarse_min(int tx, int ty) { return tile_min[tx + ty*tiles_x]; }
+  // nakon pisanja u plocicu ponovno izracuna njen maksimum i minimum
+  void update(int tx, int ty) {
+    float hi = numeric_limits<float>::lowest(), lo = numeric_limits<float>::max();
+    for (int y = ty*tile; y < min(ty*tile + tile, h); y++)
+      for (int x = tx*tile; x < min(tx*tile + tile, w); x++) {
+        hi = max(hi, at(x, y));
+        lo = min(lo, at(x, y));
+      }
+    coarse(tx, ty) = hi;
+    coarse_min(tx, ty) = lo;
+  }
+};
 
-struct Plane {
-  Vec3f n;
-  float d;
-  Vec3f p;
-  Plane() {Plane(Vec3f(0, 0, 0), 0);}
-  Plane(const Vec3f& n, const float& d): n(n), d(d) {
-    float x = n[0]*d / (n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
-    float y = n[1]*d / (n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
-    float z = n[2]*d / (n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
-    p = {x, y, z};
+// Redak bloka od 8 piksela odjednom: pokrivenost iz tri brida i test dubine kao bitovne maske
+// (bit i je piksel x + i). SSE i skalarna verzija racunaju dubinu istim operacijama
+struct BlockRow {
+  int A[3];
+#ifdef RAST_SSE
+  __m128i step_lo[3], step_hi[3];
+#endif
+  BlockRow(int A0, int A1, int A2): A{A0, A1, A2} {
+#ifdef RAST_SSE
+    for (int k = 0; k < 3; k++) {
+      step_lo[k] = _mm_setr_epi32(0, A[k], 2*A[k], 3*A[k]);
+      step_hi[k] = _mm_add_epi32(step_lo[k], _mm_set1_epi32(4*A[k]));
+    }
+#endif
+  }
+  unsigned coverage(int w0, int w1, int w2) const {
+#ifdef RAST_SSE
+    __m128i b0 = _mm_set1_epi32(w0), b1 = _mm_set1_epi32(w1), b2 = _mm_set1_epi32(w2);
+    __m128i lo = _mm_or_si128(_mm_or_si128(_mm_add_epi32(b0, step_lo[0]), _mm_add_epi32(b1, step_lo[1])), _mm_add_epi32(b2, step_lo[2]));
+    __m128i hi = _mm_or_si128(_mm_or_si128(_mm_add_epi32(b0, step_hi[0]), _mm_add_epi32(b1, step_hi[1])), _mm_add_epi32(b2, step_hi[2]));
+    // predznak je u najvisem bitu pa movemask vraca negativne
+    unsigned neg = _mm_movemask_ps(_mm_castsi128_ps(lo)) | _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+    return ~neg & 0xFF;
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 8; i++)
+      if (((w0 + A[0]*i) | (w1 + A[1]*i) | (w2 + A[2]*i)) >= 0) mask |= 1 << i;
+    return mask;
+#endif
+  }
+  // upisuje dubinu pikselima iz mask koji su blizi od postojecih i vraca njih
+  static unsigned depth(float* d, float zrow, float dzdx, unsigned mask) {
+#ifdef RAST_SSE
+    const __m128 lanes[2] = {_mm_setr_ps(0, 1, 2, 3), _mm_setr_ps(4, 5, 6, 7)};
+    const __m128i bits[2] = {_mm_setr_epi32(1, 2, 4, 8), _mm_setr_epi32(16, 32, 64, 128)};
+    unsigned out = 0;
+    for (int k = 0; k < 2; k++) {
+      __m128 z = _mm_add_ps(_mm_set1_ps(zrow), _mm_mul_ps(_mm_set1_ps(dzdx), lanes[k]));
+      __m128 old = _mm_loadu_ps(d + 4*k);
+      __m128 m = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits[k]), bits[k]));
+      m = _mm_and_ps(m, _mm_cmplt_ps(z, old));
+      _mm_storeu_ps(d + 4*k, _mm_or_ps(_mm_and_ps(m, z), _mm_andnot_ps(m, old)));
+      out |= _mm_movemask_ps(m) << 4*k;
+    }
+    return out;
+#else
+    unsigned out = 0;
+    for (int i = 0; i < 8; i++) {
+      float z = zrow + dzdx*(float)i;
+      if ((mask >> i & 1) && z < d[i]) { d[i] = z; out |= 1 << i; }
+    }
+    return out;
+#endif
+  }
+  // potpuno pokriven blok ispred svega u plocici: dubina se samo upisuje
+  static void fill(float* d, float zrow, float dzdx) {
+#ifdef RAST_SSE
+    __m128 zr = _mm_set1_ps(zrow), dz = _mm_set1_ps(dzdx);
+    _mm_storeu_ps(d, _mm_add_ps(zr, _mm_mul_ps(dz, _mm_setr_ps(0, 1, 2, 3))));
+    _mm_storeu_ps(d + 4, _mm_add_ps(zr, _mm_mul_ps(dz, _mm_setr_ps(4, 5, 6, 7))));
+#else
+    for (int i = 0; i < 8; i++) d[i] = zrow + dzdx*(float)i;
+#endif
+  }
+};
+
+// pravokutnik slike u koji se crta: cijela slika ili jedna plocica s vlastitom memorijom
+struct Target {
+  int x0, y0, w, h;
+  unsigned char* color; // w*h piksela po bytespp bajtova, redak po redak
+  int bytespp;
+  DepthBuffer* depth;   // istih dimenzija, u lokalnim koordinatama
+  // visibility buffer za odgodeno sjencanje: ako postoji, umjesto boje se pise indeks trokuta
+  int* ids = nullptr;
+  Target(int x0, int y0, int w, int h, unsigned char* color, int bytespp, DepthBuffer* depth):
+    x0(x0), y0(y0), w(w), h(h), color(color), bytespp(bytespp), depth(depth) {}
+  // cijela slika, dijeli memoriju s njom
+  Target(TGAImage& image, DepthBuffer& depth):
+    Target(0, 0, image.get_width(), image.get_height(), image.buffer(), image.get_bytespp(), &depth) {}
+  void set(int x, int y, const TGAColor& c) {
+    memcpy(color + ((x - x0) + (y - y0)*w)*bytespp, c.raw, bytespp);
+  }
+  void set_visible(int x, int y, int id) {
+    ids[(x - x0) + (y - y0)*w] = id;
   }
 };
 
+// vrh trokuta na ekranu: x, y u pikselima i z dubina; w je iz prostora odsijecanja
+// (1 bez projekcije) i sluzi za perspektivno ispravnu interpolaciju UV-a
+struct Vertex {
+  Vec3f p;
+  Vec2f uv;
+  float w;
+  Vertex(const Vec3f& p = Vec3f(), const Vec2f& uv = Vec2f(), float w = 1): p(p), uv(uv), w(w) {}
+};
+
+// Tekstura kao niz razina s texelima u BGRA (uint32), razina 0 je originalna slika, ostale su
+// mipmape. UV (0, 0) je donji lijevi kut slike kao u OBJ-u, izvan [0, 1] se uzima rub
 struct Texture {
-  TGAImage image;
-  Texture(const char *filename) {
+  enum Filter { NEAREST, BILINEAR };
+  struct Level {
+    int w, h;
+    vector<uint32_t> texels;
+    uint32_t at(int x, int y) const {
+      x = min(max(x, 0), w - 1);
+      y = min(max(y, 0), h - 1);
+      return texels[x + y*w];
+    }
+  };
+  vector<Level> levels;
+  Filter filter;
+  Texture(const char *filename, Filter filter = NEAREST, bool mipmaps = false): filter(filter) {
+    TGAImage image;
     image.read_tga_file(filename);
+    Level base{image.get_width(), image.get_height(), {}};
+    int bpp = image.get_bytespp();
+    const unsigned char *p = image.buffer();
+    if (!p || base.w <= 0 || base.h <= 0) base = Level{1, 1, {0}};
+    else {
+      base.texels.resize(base.w*base.h);
+      for (int i = 0; i < base.w*base.h; i++, p += bpp) {
+        if (bpp == 1) base.texels[i] = p[0] | p[0] << 8 | p[0] << 16 | 0xFF000000u;
+        else base.texels[i] = p[0] | p[1] << 8 | p[2] << 16 | (bpp == 4 ? (uint32_t)p[3] << 24 : 0xFF000000u);
+      }
+    }
+    levels.push_back(base);
+    while (mipmaps && (levels.back().w > 1 || levels.back().h > 1)) levels.push_back(half(levels.back()));
   }
-  TGAColor map(int x, int y, int lx, int ly, int hx, int hy) {
-    int i = round(image.get_width()*(float)(x-lx)/(hx-lx));
-    int j = round(image.get_height()*(float)(y-ly)/(hy-ly));
-    return image.get(i, j);
+  // prosjek 2x2 texela, na neparnom rubu se zadnji stupac/redak ponavlja
+  static Level half(const Level& src) {
+    Level dst{max(src.w/2, 1), max(src.h/2, 1), {}};
+    dst.texels.resize(dst.w*dst.h);
+    for (int y = 0; y < dst.h; y++)
+      for (int x = 0; x < dst.w; x++) {
+        int sx = min(2*x + 1, src.w - 1), sy = min(2*y + 1, src.h - 1);
+        uint32_t t[4] = {src.texels[2*x + 2*y*src.w], src.texels[sx + 2*y*src.w], src.texels[2*x + sy*src.w], src.texels[sx + sy*src.w]};
+        uint32_t out = 0;
+        for (int c = 0; c < 32; c += 8) {
+          uint32_t sum = 2;
+          for (int k = 0; k < 4; k++) sum += t[k] >> c & 0xFF;
+          out |= (sum >> 2) << c;
+        }
+        dst.texels[x + y*dst.w] = out;
+      }
+    return dst;
+  }
+  // razina detalja iz promjene UV-a po pikselu na ekranu
+  float lod(float dudx, float dvdx, float dudy, float dvdy) const {
+    if (levels.size() == 1) return 0;
+    float w = levels[0].w, h = levels[0].h;
+    float rho = max(hypot(dudx*w, dvdx*h), hypot(dudy*w, dvdy*h));
+    return rho > 1 ? log2(rho) : 0;
+  }
+  uint32_t sample(float u, float v, float lod = 0) const {
+    const Level &l = levels[min((int)(lod + 0.5f), (int)levels.size() - 1)];
+    float x = u*l.w, y = (1 - v)*l.h;
+    if (filter == NEAREST) return l.at(floor(x), floor(y));
+    x -= 0.5f; y -= 0.5f;
+    int ix = floor(x), iy = floor(y);
+    // tezine u 8 bita
+    uint32_t fx = (x - ix)*256, fy = (y - iy)*256;
+    uint32_t t00 = l.at(ix, iy), t10 = l.at(ix + 1, iy), t01 = l.at(ix, iy + 1), t11 = l.at(ix + 1, iy + 1);
+    uint32_t out = 0;
+    for (int c = 0; c < 32; c += 8) {
+      uint32_t top = (t00 >> c & 0xFF)*(256 - fx) + (t10 >> c & 0xFF)*fx;
+      uint32_t bottom = (t01 >> c & 0xFF)*(256 - fx) + (t11 >> c & 0xFF)*fx;
+      out |= ((top*(256 - fy) + bottom*fy + (1 << 15)) >> 16) << c;
+    }
+    return out;
   }
 };
 
-bool planeSegmentIntersection(Vec3f p0, Vec3f p1, Plane* s0, Vec3f& res) {
-  float u = (s0->d - s0->n*p1)/(s0->n*(p0-p1));
-	if (u <= 0.0 || u > 1.0) return false;
-  res = p0*u + p1*(1-u);
-	return true;
-}
+// vrh u homogenom prostoru odsijecanja, prije dijeljenja s w
+struct ClipVertex {
+  Vec4f p;
+  Vec2f uv;
+};
 
-void line(int x0, int y0, int x1, int y1, TGAImage &image, TGAColor color, bool check = false) {
-  int dx = x1 - x0, dy = y1 - y0;
-  float x = x0, y = y0;
-  int steps = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
-  float Xinc = dx/(float)steps;
-  float Yinc = dy/(float)steps;
-  for (int i = 0; i <= steps; i++){
-    int rx = round(x); int ry = round(y);
-    //image.set(rx,ry,color);
-    if(check){
-      contour[ry][0] = min(contour[ry][0], rx);
-      contour[ry][1] = max(contour[ry][1], rx);
-    }
-    x += Xinc; y += Yinc;
+// 4x4 matrica po redcima, vektor je stupac: p' = M*p. Desni koordinatni sustav kao u OBJ-u,
+// kamera gleda prema -z, a projekcije preslikavaju dubinu u [0, 1] (manji je blizi)
+struct Matrix {
+  float m[4][4];
+  Matrix() {
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++) m[i][j] = i == j;
   }
+  Matrix operator*(const Matrix& b) const {
+    Matrix r;
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++) {
+        r.m[i][j] = 0;
+        for (int k = 0; k < 4; k++) r.m[i][j] += m[i][k]*b.m[k][j];
+      }
+    return r;
+  }
+  // isti redoslijed zbrajanja kao u SIMD transformaciji vrhova
+  Vec4f operator*(const Vec3f& p) const {
+    float r[4];
+    for (int i = 0; i < 4; i++) r[i] = m[i][0]*p.x + m[i][1]*p.y + m[i][2]*p.z + m[i][3];
+    return Vec4f(r[0], r[1], r[2], r[3]);
+  }
+  static Matrix translate(const Vec3f& t) {
+    Matrix r;
+    r.m[0][3] = t.x; r.m[1][3] = t.y; r.m[2][3] = t.z;
+    return r;
+  }
+  static Matrix scale(const Vec3f& s) {
+    Matrix r;
+    r.m[0][0] = s.x; r.m[1][1] = s.y; r.m[2][2] = s.z;
+    return r;
+  }
+  static Matrix look_at(const Vec3f& eye, const Vec3f& center, const Vec3f& up) {
+    Vec3f z = (eye - center).normalize(), x = cross(up, z).normalize(), y = cross(z, x);
+    Matrix r;
+    for (int j = 0; j < 3; j++) { r.m[0][j] = x[j]; r.m[1][j] = y[j]; r.m[2][j] = z[j]; }
+    r.m[0][3] = -(x*eye); r.m[1][3] = -(y*eye); r.m[2][3] = -(z*eye);
+    return r;
+  }
+  // vidljivo je l <= x <= r, b <= y <= t i -near >= z >= -far
+  static Matrix ortho(float l, float r, float b, float t, float near, float far) {
+    Matrix o;
+    o.m[0][0] = 2/(r - l); o.m[0][3] = -(r + l)/(r - l);
+    o.m[1][1] = 2/(t - b); o.m[1][3] = -(t + b)/(t - b);
+    o.m[2][2] = -1/(far - near); o.m[2][3] = -near/(far - near);
+    return o;
+  }
+  // fovy u radijanima
+  static Matrix perspective(float fovy, float aspect, float near, float far) {
+    Matrix p;
+    float f = 1/tan(fovy/2);
+    p.m[0][0] = f/aspect; p.m[1][1] = f;
+    p.m[2][2] = far/(near - far); p.m[2][3] = near*far/(near - far);
+    p.m[3][2] = -1; p.m[3][3] = 0;
+    return p;
+  }
+};
+
+// NDC -> ekran: x, y iz [-1, 1] idu preko slike, a z iz [0, 1] (manji je blizi) postaje dubina
+struct Viewport {
+  int w, h;
+  Viewport(int w, int h): w(w), h(h) {}
+  Vertex to_screen(const ClipVertex& v) const {
+    float iw = 1/v.p.w;
+    return Vertex(Vec3f((v.p.x*iw*0.5f + 0.5f)*w, (v.p.y*iw*0.5f + 0.5f)*h, v.p.z*iw), v.uv, v.p.w);
+  }
+};
+
+// Sutherland-Hodgman rezanje u homogenom prostoru. Reze se samo po near/far ravnini i po
+// guard bandu |x|, |y| <= guard*w; trokut koji izlazi iz slike, ali ne i iz guard banda,
+// ide u rasterizer cijeli jer on ionako crta samo unutar slike. Trokut koji je cijeli
+// s vanjske strane neke ravnine slike se odbacuje bez rezanja
+struct Clipper {
+  enum { NEAR = 1, FAR = 2, LEFT = 4, RIGHT = 8, BOTTOM = 16, TOP = 32 };
+  float guard;
+  vector<ClipVertex> in, out; // poligon tijekom rezanja, ponovno se koriste
+  Clipper(float guard = 4): guard(guard) {}
+  // udaljenost od ravnine, pozitivna s unutarnje strane; g = 1 je rub slike
+  static float distance(const Vec4f& p, int plane, float g) {
+    switch (plane) {
+      case NEAR: return p.z;
+      case FAR: return p.w - p.z;
+      case LEFT: return p.x + g*p.w;
+      case RIGHT: return g*p.w - p.x;
+      case BOTTOM: return p.y + g*p.w;
+      default: return g*p.w - p.y;
+    }
+  }
+  static int outcode(const Vec4f& p, float g) {
+    int code = 0;
+    for (int plane = NEAR; plane <= TOP; plane <<= 1)
+      if (distance(p, plane, g) < 0) code |= plane;
+    return code;
+  }
+  // dodaje odrezani trokut kao lepezu trokuta (po 3 vrha na ekranu) u result; mask su ravnine
+  // guard banda koje trokut sijece, a trokut potpuno izvan pogleda odbacuje pozivatelj
+  int clip(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, int mask, const Viewport& view, vector<Vertex>& result) {
+    if (!mask) {
+      result.push_back(view.to_screen(a));
+      result.push_back(view.to_screen(b));
+      result.push_back(view.to_screen(c));
+      return 1;
+    }
+    in.assign({a, b, c});
+    for (int plane = NEAR; plane <= TOP && !in.empty(); plane <<= 1) {
+      if (!(mask & plane)) continue;
+      out.clear();
+      for (size_t i = 0; i < in.size(); i++) {
+        const ClipVertex &p = in[i], &q = in[(i + 1) % in.size()];
+        float dp = distance(p.p, plane, guard), dq = distance(q.p, plane, guard);
+        // vrh na ravnini je unutra i ne stvara novo sjeciste
+        if (dp >= 0) out.push_back(p);
+        if ((dp > 0 && dq < 0) || (dp < 0 && dq > 0)) {
+          float t = dp/(dp - dq);
+          out.push_back({p.p + (q.p - p.p)*t, p.uv + (q.uv - p.uv)*t});
+        }
+      }
+      swap(in, out);
+    }
+    if (in.size() < 3) return 0;
+    for (size_t i = 1; i + 1 < in.size(); i++) {
+      result.push_back(view.to_screen(in[0]));
+      result.push_back(view.to_screen(in[i]));
+      result.push_back(view.to_screen(in[i + 1]));
+    }
+    return in.size() - 2;
+  }
+};
+
+// koordinate na ekranu u fiksnom zarezu 28.4, sredista piksela su na pola piksela
+const int subpixel_bits = 4;
+const int subpixel = 1 << subpixel_bits;
+
+inline int to_fixed(float v) { return lrintf(v*subpixel); }
+// prvi i zadnji piksel cije je srediste u [lo, hi]; >> zaokruzuje prema dolje i za negativne
+inline int first_pixel(int lo) { return (lo - subpixel/2 + subpixel - 1) >> subpixel_bits; }
+inline int last_pixel(int hi) { return (hi - subpixel/2) >> subpixel_bits; }
+
+// pikseli cija sredista mogu biti u trokutu, isto za rasterizer i za razvrstavanje po plocicama
+inline void pixel_bounds(const Vertex& a, const Vertex& b, const Vertex& c, int& lx, int& ly, int& hx, int& hy) {
+  int x[3] = {to_fixed(a.p.x), to_fixed(b.p.x), to_fixed(c.p.x)}, y[3] = {to_fixed(a.p.y), to_fixed(b.p.y), to_fixed(c.p.y)};
+  lx = first_pixel(min(x[0], min(x[1], x[2])));
+  ly = first_pixel(min(y[0], min(y[1], y[2])));
+  hx = last_pixel(max(x[0], max(x[1], x[2])));
+  hy = last_pixel(max(y[0], max(y[1], y[2])));
 }
 
-void triangle(int x0, int y0, int x1, int y1, int x2, int y2, TGAImage &image, TGAColor color, Texture* txt) {
-  for(int i = 0; i < height; i++){
-    contour[i][0] = width;
-    contour[i][1] = -1;
-  }
-  line(x0, y0, x1, y1, image, color, true);
-  line(x1, y1, x2, y2, image, color, true);
-  line(x0, y0, x2, y2, image, color, true);
-
-  for(int i = 0; i < height; i++){
-    if(contour[i][1] != -1){
-      int size = contour[i][1] - contour[i][0] + 1;
-      while(size--){
-        int x = contour[i][0] + size;
-        int y = i;
-        if(txt != nullptr){
-          int lx = min(x0, min(x1, x2)), ly = min(y0, min(y1, y2)), hx = max(x0, max(x1, x2)), hy = max(y0, max(y1, y2));
-          image.set(x, y, txt->map(x, y, lx, ly, hx, hy));
+// brid (a, b) kao funkcija E(x, y) = A*x + B*y + C u 28.4, pozitivna s unutarnje strane;
+// vrijednosti su tocne, ali trebaju 64 bita
+struct Edge {
+  int A, B;
+  int64_t C;
+  Edge(): A(0), B(0), C(0) {}
+  Edge(int ax, int ay, int bx, int by): A(ay - by), B(bx - ax), C((int64_t)ax*by - (int64_t)ay*bx) {
+    // top-left pravilo: piksel tocno na bridu pripada samo lijevom ili gornjem bridu,
+    // pa se zajednicki brid dva trokuta ne crta dvaput
+    bool top_left = A > 0 || (A == 0 && B < 0);
+    if (!top_left) C--;
+  }
+  // vrijednost u sredistu piksela (x, y)
+  int64_t operator()(int x, int y) const {
+    return (int64_t)A*(x*subpixel + subpixel/2) + (int64_t)B*(y*subpixel + subpixel/2) + C;
+  }
+};
+
+// atribut linearan po ekranu: vrijednost u vrhu (x0, y0) i gradijenti po pikselu, racunaju se
+// jednom po trokutu; vrijednost se uzima u sredistu piksela
+struct Gradient {
+  float a0, dx, dy, x0, y0;
+  Gradient(): a0(0), dx(0), dy(0), x0(0), y0(0) {}
+  Gradient(const Edge* e, int64_t area, float x0, float y0, float a0, float a1, float a2):
+    a0(a0), dx((e[0].A*a0 + e[1].A*a1 + e[2].A*a2)*subpixel/area), dy((e[0].B*a0 + e[1].B*a1 + e[2].B*a2)*subpixel/area), x0(x0), y0(y0) {}
+  float operator()(int x, int y) const { return a0 + dx*(x + 0.5f - x0) + dy*(y + 0.5f - y0); }
+};
+
+// trokut u fiksnoj tocki s vrhovima poredanim suprotno od kazaljke na ekranu; area je 0 za
+// degenerirani. Iz istog postava crtanje i odgodeno sjencanje dobivaju iste ravnine
+struct FixedTriangle {
+  Vertex v0, v1, v2;
+  int x0, y0, x1, y1, x2, y2;
+  int64_t area;
+  bool swapped;
+  Edge e[3];
+  float fx0, fy0; // prvi vrh u pikselima, ishodiste ravnina
+  FixedTriangle(const Vertex& a, const Vertex& b, const Vertex& c): v0(a), v1(b), v2(c) {
+    x0 = to_fixed(v0.p.x), y0 = to_fixed(v0.p.y), x1 = to_fixed(v1.p.x), y1 = to_fixed(v1.p.y), x2 = to_fixed(v2.p.x), y2 = to_fixed(v2.p.y);
+    area = (int64_t)(x1 - x0)*(y2 - y0) - (int64_t)(y1 - y0)*(x2 - x0);
+    swapped = area < 0;
+    if (swapped) { swap(x1, x2); swap(y1, y2); swap(v1, v2); area = -area; }
+    e[0] = Edge(x1, y1, x2, y2); e[1] = Edge(x2, y2, x0, y0); e[2] = Edge(x0, y0, x1, y1);
+    fx0 = (float)x0/subpixel; fy0 = (float)y0/subpixel;
+  }
+};
+
+// UV se interpolira perspektivno ispravno: linearni su u/w, v/w i 1/w
+struct Perspective {
+  Gradient q, s, t;
+  Perspective() {}
+  Perspective(const FixedTriangle& f) {
+    float q0 = 1/f.v0.w, q1 = 1/f.v1.w, q2 = 1/f.v2.w;
+    q = Gradient(f.e, f.area, f.fx0, f.fy0, q0, q1, q2);
+    s = Gradient(f.e, f.area, f.fx0, f.fy0, f.v0.uv.x*q0, f.v1.uv.x*q1, f.v2.uv.x*q2);
+    t = Gradient(f.e, f.area, f.fx0, f.fy0, f.v0.uv.y*q0, f.v1.uv.y*q1, f.v2.uv.y*q2);
+  }
+  // mip razina jednom po bloku s kutem (X, Y), iz derivacija u = s/q i v = t/q u sredini bloka
+  float lod(const Texture* txt, int X, int Y) const {
+    int cx = X + DepthBuffer::tile/2, cy = Y + DepthBuffer::tile/2;
+    float qc = q(cx, cy), uc = s(cx, cy)/qc, vc = t(cx, cy)/qc;
+    return txt->lod((s.dx - uc*q.dx)/qc, (t.dx - vc*q.dx)/qc, (s.dy - uc*q.dy)/qc, (t.dy - vc*q.dy)/qc);
+  }
+  // piksel (X + i, y), koraci od pocetka retka bloka
+  TGAColor sample(const Texture* txt, int X, int y, int i, float lod) const {
+    float qi = q(X, y) + q.dx*i;
+    return TGAColor(txt->sample((s(X, y) + s.dx*i)/qi, (t(X, y) + t.dx*i)/qi, lod), 4);
+  }
+};
+
+// prolazi samo kroz bounding box trokuta unutar odredista, po 8x8 blokovima z-spremnika.
+// Blok izvan nekog brida se preskace, a za potpuno pokriven blok nema testa pokrivenosti
+// (ni dubine ako je ispred cijele plocice); inace se redak od 8 piksela racuna odjednom.
+// Vrhovi se zaokruzuju na 1/16 piksela i bridovi su tocni, pa je svaki piksel uz zajednicki
+// brid pokriven tocno jednom. Sve se racuna u koordinatama slike pa rezultat ne ovisi o
+// tome kako je slika podijeljena. Ako odrediste ima visibility buffer, ne sjenca se nego se
+// pise samo id trokuta
+void triangle(Vertex v0, Vertex v1, Vertex v2, Target &target, TGAColor color, Texture* txt, int id = -1) {
+  FixedTriangle f(v0, v1, v2);
+  if (f.area == 0) return;
+  const Edge* e = f.e;
+  int64_t area = f.area;
+  bool visibility = target.ids != nullptr;
+  if (visibility) txt = nullptr;
+
+  int lx, ly, hx, hy;
+  pixel_bounds(v0, v1, v2, lx, ly, hx, hy);
+  int minx = max(lx, target.x0), miny = max(ly, target.y0);
+  int maxx = min(hx, target.x0 + target.w - 1), maxy = min(hy, target.y0 + target.h - 1);
+  if (minx > maxx || miny > maxy) return;
+
+  BlockRow row(e[0].A*subpixel, e[1].A*subpixel, e[2].A*subpixel);
+  Gradient plane(e, area, f.fx0, f.fy0, f.v0.p.z, f.v1.p.z, f.v2.p.z);
+  float dzdx = plane.dx, dzdy = plane.dy;
+  Perspective uv;
+  if (txt != nullptr) uv = Perspective(f);
+
+  DepthBuffer &depth = *target.depth;
+  const int T = DepthBuffer::tile;
+  for (int ty = miny/T; ty <= maxy/T; ty++) {
+    for (int tx = minx/T; tx <= maxx/T; tx++) {
+      int X = tx*T, Y = ty*T;
+      int bx0 = max(X, minx), by0 = max(Y, miny);
+      int bx1 = min(X + T - 1, maxx), by1 = min(Y + T - 1, maxy);
+      int ctx = tx - target.x0/T, cty = ty - target.y0/T;
+
+      // ravnina je linearna pa je najmanja i najveca dubina na dijelu bloka unutar
+      // bounding boxa u kutovima; vecina zaklonjenih blokova tu i zavrsi
+      float z0 = plane(bx0, by0), zx = dzdx*(bx1 - bx0), zy = dzdy*(by1 - by0);
+      float zmin = z0 + min(zx, 0.f) + min(zy, 0.f);
+      float zmax = z0 + max(zx, 0.f) + max(zy, 0.f);
+      if (zmin >= depth.coarse(ctx, cty)) continue;
+
+      // isto vrijedi za bridove na cijelom bloku
+      int c[3];
+      bool outside = false, inside = bx0 == X && by0 == Y && bx1 == X + T - 1 && by1 == Y + T - 1;
+      for (int k = 0; k < 3; k++) {
+        int64_t c64 = e[k](X, Y), dx = (int64_t)e[k].A*subpixel*(T - 1), dy = (int64_t)e[k].B*subpixel*(T - 1);
+        if (c64 + max(dx, (int64_t)0) + max(dy, (int64_t)0) < 0) outside = true;
+        if (c64 + min(dx, (int64_t)0) + min(dy, (int64_t)0) < 0) inside = false;
+        // unutar bloka se brid promijeni puno manje od 2^30 pa ogranicenje cuva predznak
+        c[k] = max(min(c64, (int64_t)1 << 30), -((int64_t)1 << 30));
+      }
+      if (outside) continue;
+      bool front = inside && zmax < depth.coarse_min(ctx, cty);
+
+      unsigned cols = (0xFFu << (bx0 - X)) & (0xFFu >> (X + T - 1 - bx1));
+      float zb = plane(X, Y);
+      float lod = txt != nullptr ? uv.lod(txt, X, Y) : 0;
+      bool written = false;
+      for (int y = by0; y <= by1; y++) {
+        int j = y - Y;
+        float zrow = zb + dzdy*(float)j;
+        float *d = &depth.at(X - target.x0, y - target.y0);
+        unsigned mask;
+        if (front) {
+          BlockRow::fill(d, zrow, dzdx);
+          mask = 0xFF;
+        } else {
+          mask = inside ? 0xFF : row.coverage(c[0] + e[0].B*subpixel*j, c[1] + e[1].B*subpixel*j, c[2] + e[2].B*subpixel*j) & cols;
+          // rani z: tekstura se cita tek kad fragment prode test dubine
+          if (mask) mask = BlockRow::depth(d, zrow, dzdx, mask);
+        }
+        if (!mask) continue;
+        written = true;
+        if (visibility) {
+          for (int i = 0; i < T; i++)
+            if (mask >> i & 1) target.set_visible(X + i, y, id);
+          continue;
         }
-        else image.set(x, y, color);
+        if (txt == nullptr) {
+          for (int i = 0; i < T; i++)
+            if (mask >> i & 1) target.set(X + i, y, color);
+          continue;
+        }
+        for (int i = 0; i < T; i++)
+          if (mask >> i & 1) target.set(X + i, y, uv.sample(txt, X, y, i, lod));
       }
+      if (written) depth.update(ctx, cty);
     }
   }
 }
 
-struct Model {
-  struct face {
-    Vec3f* v0;
-    Vec3f* v1;
-    Vec3f* v2;
-    face() {face(nullptr,nullptr,nullptr);}
-    face(Vec3f* v0, Vec3f* v1, Vec3f* v2): v0{v0}, v1{v1}, v2{v2} {}
+void triangle(Vertex v0, Vertex v1, Vertex v2, TGAImage &image, DepthBuffer &depth, TGAColor color, Texture* txt) {
+  Target target(image, depth);
+  triangle(v0, v1, v2, target, color, txt);
+}
+
+// Slika se dijeli na plocice 64x64 koje imaju svoju boju i z-spremnik, pa dretve ne dijele
+// memoriju. Trokuti se prvo razvrstaju po plocicama (redoslijed crtanja ostaje isti),
+// a zatim se plocice crtaju paralelno; rezultat je jednak serijskom crtanju.
+// U odgodenom nacinu prvi prolaz po plocici pise samo dubinu i id vidljivog trokuta, a drugi
+// paralelni prolaz sjenca svaki vidljivi piksel tocno jednom, neovisno o preklapanju. UV i mip
+// razina racunaju se iz istih ravnina i po istim blokovima kao pri izravnom crtanju, pa je slika ista
+struct TileRenderer {
+  static const int tile = 64; // visekratnik DepthBuffer::tile
+  struct Triangle {
+    Vertex v0, v1, v2;
+    TGAColor color;
+    Texture* txt;
   };
-  vector<Vec3f> vertices;
-  list<face> faces;
+  struct Tile {
+    int x0, y0, w, h;
+    vector<unsigned char> color;
+    DepthBuffer depth;
+    vector<int> triangles;
+    vector<int> ids;
+    Tile(int x0, int y0, int w, int h): x0(x0), y0(y0), w(w), h(h), depth(w, h) {}
+  };
+  int w, h, tiles_x, tiles_y;
+  bool deferred = false;
+  vector<Triangle> triangles;
+  vector<Perspective> shading; // samo za teksturirane trokute
+  vector<Tile> tiles;
+
+  TileRenderer(int w, int h): w(w), h(h), tiles_x((w + tile - 1)/tile), tiles_y((h + tile - 1)/tile) {
+    for (int ty = 0; ty < tiles_y; ty++)
+      for (int tx = 0; tx < tiles_x; tx++)
+        tiles.emplace_back(tx*tile, ty*tile, min(w - tx*tile, (int)tile), min(h - ty*tile, (int)tile));
+  }
+  void add(const Vertex& v0, const Vertex& v1, const Vertex& v2, TGAColor color, Texture* txt) {
+    triangles.push_back({v0, v1, v2, color, txt});
+  }
+  // razvrstavanje po istom rasponu piksela koji koristi triangle()
+  void bin() {
+    for (auto &t : tiles) t.triangles.clear();
+    for (int i = 0; i < (int)triangles.size(); i++) {
+      const Triangle &t = triangles[i];
+      int lx, ly, hx, hy;
+      pixel_bounds(t.v0, t.v1, t.v2, lx, ly, hx, hy);
+      if (hx < lx || hy < ly || hx < 0 || hy < 0 || lx >= w || ly >= h) continue;
+      for (int ty = max(ly, 0)/tile; ty <= min(hy, h - 1)/tile; ty++)
+        for (int tx = max(lx, 0)/tile; tx <= min(hx, w - 1)/tile; tx++)
+          tiles[tx + ty*tiles_x].triangles.push_back(i);
+    }
+  }
+  // boja vidljivog piksela (x, y); mip razina je ona bloka kojem piksel pripada
+  TGAColor shade(int id, int x, int y) const {
+    const Triangle &t = triangles[id];
+    if (t.txt == nullptr) return t.color;
+    const int T = DepthBuffer::tile;
+    int X = x/T*T;
+    return shading[id].sample(t.txt, X, y, x - X, shading[id].lod(t.txt, X, y/T*T));
+  }
+  // crta sve dodane trokute preko postojecog sadrzaja slike, z-spremnik krece prazan;
+  // nakon toga je popis trokuta prazan za sljedeci frame
+  void render(TGAImage& image, int threads = thread_count()) {
+    bin();
+    int bpp = image.get_bytespp();
+    unsigned char* data = image.buffer();
+    parallel_for(tiles.size(), [&](int i) {
+      Tile &t = tiles[i];
+      t.depth.clear();
+      Target target(t.x0, t.y0, t.w, t.h, nullptr, bpp, &t.depth);
+      if (deferred) {
+        // prvi prolaz ne cita ni ne pise boju
+        t.ids.assign(t.w*t.h, -1);
+        target.ids = t.ids.data();
+      } else {
+        t.color.resize(t.w*t.h*bpp);
+        for (int y = 0; y < t.h; y++)
+          memcpy(&t.color[y*t.w*bpp], data + (t.x0 + (t.y0 + y)*w)*bpp, t.w*bpp);
+        target.color = t.color.data();
+      }
+      for (int j : t.triangles) {
+        const Triangle &tri = triangles[j];
+        triangle(tri.v0, tri.v1, tri.v2, target, tri.color, tri.txt, j);
+      }
+      if (!deferred)
+        for (int y = 0; y < t.h; y++)
+          memcpy(data + (t.x0 + (t.y0 + y)*w)*bpp, &t.color[y*t.w*bpp], t.w*bpp);
+    }, threads);
+
+    if (deferred) {
+      shading.resize(triangles.size());
+      parallel_for(triangles.size(), [&](int i) {
+        const Triangle &t = triangles[i];
+        if (t.txt != nullptr) shading[i] = Perspective(FixedTriangle(t.v0, t.v1, t.v2));
+      }, threads);
+      parallel_for(tiles.size(), [&](int i) {
+        Tile &t = tiles[i];
+        for (int y = 0; y < t.h; y++)
+          for (int x = 0; x < t.w; x++) {
+            int id = t.ids[x + y*t.w];
+            if (id < 0) continue;
+            TGAColor c = shade(id, t.x0 + x, t.y0 + y);
+            memcpy(data + (t.x0 + x + (t.y0 + y)*w)*bpp, c.raw, bpp);
+          }
+      }, threads);
+    }
+    triangles.clear();
+    shading.clear();
+  }
+};
+
+// Post-transform cache: svaki vrh modela se transformira jednom po crtanju, u SoA nizovima.
+// Uz prostor odsijecanja se odmah racunaju polozaj na ekranu i outcodeovi prema guard bandu
+// i prema slici, pa sastavljanje trokuta samo cita gotove vrijednosti
+struct VertexCache {
+  vector<float> x, y, z, w;    // prostor odsijecanja
+  vector<float> sx, sy, sz;    // ekran, vrijedi za vrhove ispred kamere
+  vector<unsigned char> guard_code, view_code;
+
+  void transform(const Matrix& m, const vector<Vec3f>& p, const Viewport& view, float guard) {
+    int n = p.size();
+    for (auto v : {&x, &y, &z, &w, &sx, &sy, &sz}) v->resize(n);
+    guard_code.resize(n);
+    view_code.resize(n);
+    int i = 0;
+#ifdef RAST_SSE
+    const __m128 half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    const __m128 vw = _mm_set1_ps(view.w), vh = _mm_set1_ps(view.h), g = _mm_set1_ps(guard);
+    __m128 row[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int k = 0; k < 4; k++) row[r][k] = _mm_set1_ps(m.m[r][k]);
+    for (; i + 4 <= n; i += 4) {
+      __m128 px = _mm_setr_ps(p[i].x, p[i+1].x, p[i+2].x, p[i+3].x);
+      __m128 py = _mm_setr_ps(p[i].y, p[i+1].y, p[i+2].y, p[i+3].y);
+      __m128 pz = _mm_setr_ps(p[i].z, p[i+1].z, p[i+2].z, p[i+3].z);
+      __m128 c[4];
+      for (int r = 0; r < 4; r++)
+        c[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(row[r][0], px), _mm_mul_ps(row[r][1], py)), _mm_mul_ps(row[r][2], pz)), row[r][3]);
+      _mm_storeu_ps(&x[i], c[0]); _mm_storeu_ps(&y[i], c[1]);
+      _mm_storeu_ps(&z[i], c[2]); _mm_storeu_ps(&w[i], c[3]);
+      __m128 iw = _mm_div_ps(one, c[3]);
+      _mm_storeu_ps(&sx[i], _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(c[0], iw), half), half), vw));
+      _mm_storeu_ps(&sy[i], _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(c[1], iw), half), half), vh));
+      _mm_storeu_ps(&sz[i], _mm_mul_ps(c[2], iw));
+      // udaljenosti od ravnina istim redom kao Clipper::distance
+      __m128 gw = _mm_mul_ps(g, c[3]);
+      int near = _mm_movemask_ps(_mm_cmplt_ps(c[2], zero));
+      int far = _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(c[3], c[2]), zero));
+      int gm[4] = {
+        _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(c[0], gw), zero)), _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(gw, c[0]), zero)),
+        _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(c[1], gw), zero)), _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(gw, c[1]), zero))};
+      int vm[4] = {
+        _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(c[0], c[3]), zero)), _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(c[3], c[0]), zero)),
+        _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(c[1], c[3]), zero)), _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(c[3], c[1]), zero))};
+      for (int k = 0; k < 4; k++) {
+        int base = (near >> k & 1)*Clipper::NEAR | (far >> k & 1)*Clipper::FAR, gc = base, vc = base;
+        for (int j = 0; j < 4; j++) {
+          if (gm[j] >> k & 1) gc |= Clipper::LEFT << j;
+          if (vm[j] >> k & 1) vc |= Clipper::LEFT << j;
+        }
+        guard_code[i + k] = gc;
+        view_code[i + k] = vc;
+      }
+    }
+#endif
+    for (; i < n; i++) {
+      Vec4f c = m*p[i];
+      x[i] = c.x; y[i] = c.y; z[i] = c.z; w[i] = c.w;
+      float iw = 1/c.w;
+      sx[i] = (c.x*iw*0.5f + 0.5f)*view.w;
+      sy[i] = (c.y*iw*0.5f + 0.5f)*view.h;
+      sz[i] = c.z*iw;
+      guard_code[i] = Clipper::outcode(c, guard);
+      view_code[i] = Clipper::outcode(c, 1);
+    }
+  }
+  ClipVertex clip_vertex(int i, const Vec2f& uv) const { return {Vec4f(x[i], y[i], z[i], w[i]), uv}; }
+  Vertex screen_vertex(int i, const Vec2f& uv) const { return Vertex(Vec3f(sx[i], sy[i], sz[i]), uv, w[i]); }
+};
+
+// Mreza u svom koordinatnom sustavu kao vertex buffer i index buffer (3 indeksa po trokutu)
+// s matricom modela. Pri crtanju se vrhovi transformiraju u cache, a trokuti se u jednom
+// prolazu odbacuju, rezu, prebacuju na ekran i odbacuju ako su okrenuti od kamere;
+// rezultat ide u pomocni spremnik koji se ponovno koristi, model ostaje isti
+struct Model {
+  enum Cull { CULL_NONE, CULL_BACK, CULL_FRONT }; // prednja strana je suprotno od kazaljke na ekranu
+  vector<Vec3f> positions;
+  vector<Vec2f> uvs; // prazno ako ih datoteka nema
+  vector<int> indices;
+  Matrix transform;
+  Cull cull = CULL_BACK;
+  VertexCache cache;
+  vector<Vertex> screen; // trokuti za rasterizer, po 3 vrha
+  Clipper clipper;
   TGAColor color;
-  Model(const string& filename, const float& scale, const Vec3f& translation, const TGAColor tgacolor){
+  Model(const string& filename, const Matrix& transform, const TGAColor tgacolor): transform(transform) {
     color = tgacolor;
-    ifstream file(filename); //obj file bez headera
-    string s;
-    while(file >> s){
-      if (s[0] == 'v') {
-        float x, y, z;
-        file >> x >> y >> z;
-        vertices.push_back({(width*(x*scale) + translation[0]), (height*(y*scale) + translation[1]), z+translation[2]});
-      } else if (s[0] == 'f') {
-        face f;
-        int a, b, c;
-        file >> a >> b >> c;
-        f.v0 = &vertices[a-1];
-        f.v1 = &vertices[b-1];
-        f.v2 = &vertices[c-1];
-        faces.push_back(f);
-      }
+    ObjMesh mesh;
+    if(!load_obj(filename, mesh)) return;
+    positions = mesh.positions;
+    uvs = mesh.uvs;
+    indices = mesh.indices;
+  }
+  int triangles() const { return indices.size()/3; }
+  // bez UV-a iz datoteke tekstura se razvuce preko bounding boxa trokuta u ravnini xy
+  static void bboxUV(const Vec3f* const* p, Vec2f* uv){
+    float lx = min(p[0]->x, min(p[1]->x, p[2]->x)), ly = min(p[0]->y, min(p[1]->y, p[2]->y));
+    float hx = max(p[0]->x, max(p[1]->x, p[2]->x)), hy = max(p[0]->y, max(p[1]->y, p[2]->y));
+    for(int k = 0; k < 3; k++){
+      uv[k].x = hx > lx ? (p[k]->x - lx)/(hx - lx) : 0;
+      uv[k].y = hy > ly ? 1 - (p[k]->y - ly)/(hy - ly) : 0;
     }
-    file.close();
-  }
-  void draw(TGAImage& img, Texture* txt = nullptr) {
-    if(faces.empty()) return;
-    for(auto f:faces){
-      triangle(
-        round(f.v0->x), round(f.v0->y), 
-        round(f.v1->x), round(f.v1->y), 
-        round(f.v2->x), round(f.v2->y), 
-        img, color, txt
-      );
-    }
-  }
-  void addTriangle(Vec3f v0, Vec3f v1, Vec3f v2){
-    vertices.push_back(v0);
-    vertices.push_back(v1);
-    vertices.push_back(v2);
-    int n = vertices.size();
-    faces.push_front(face(&vertices[n-1], &vertices[n-2], &vertices[n-3]));
-  }
-  void clip(vector<Plane*> planes){  // ne provjerava slucaj kad jedna od tocaka lezi na plohi
-    for(auto s:planes){
-      auto i = faces.begin();
-      while(i != faces.end()){
-        Vec3f p0 = *(i->v0), p1 = *(i->v1), p2 = *(i->v2);
-        vector<Vec3f> interPoints;
-        Vec3f res;
-        if(planeSegmentIntersection(p0, p1, s, res)) interPoints.push_back(res);
-        if(planeSegmentIntersection(p1, p2, s, res)) interPoints.push_back(res);
-        if(planeSegmentIntersection(p2, p0, s, res)) interPoints.push_back(res);
-        cout << interPoints.size() << endl;
-        if(interPoints.size() == 0){
-          if(s->n*p0 + s->d < 0){
-            i = faces.erase(i);
-          } else i++;
-        } else if(interPoints.size() == 2){
-          vector<Vec3f> newPoints;
-          if(s->n*(p0 - s->p) < 0) newPoints.push_back(p0);
-          if(s->n*(p1 - s->p) < 0) newPoints.push_back(p1);
-          if(s->n*(p2 - s->p) < 0) newPoints.push_back(p2);
-          if(newPoints.size() == 2){
-            Vec3f further = (interPoints[0]-newPoints[0]).norm() < (interPoints[1]-newPoints[0]).norm() ? interPoints[1] : interPoints[0];
-            Vec3f closer = (interPoints[0]-newPoints[0]).norm() < (interPoints[1]-newPoints[0]).norm() ? interPoints[0] : interPoints[1];
-            this->addTriangle(newPoints[0], further, newPoints[1]);
-            this->addTriangle(newPoints[0], further, closer);
-          } else if(newPoints.size() == 1){
-            this->addTriangle(newPoints[0], interPoints[0], interPoints[1]);
-          }
-          i = faces.erase(i);
-        } else i++;
+  }
+  bool culled(const Vertex& a, const Vertex& b, const Vertex& c) const {
+    if(cull == CULL_NONE) return false;
+    float area = (b.p.x - a.p.x)*(c.p.y - a.p.y) - (b.p.y - a.p.y)*(c.p.x - a.p.x);
+    return cull == CULL_BACK ? area <= 0 : area >= 0;
+  }
+  // UV-ovi kutova trokuta t; bez UV-a iz datoteke racunaju se samo kad se crta s teksturom,
+  // pa vrhovi ostaju dijeljeni i transformiraju se jednom
+  void corner_uvs(int t, bool textured, Vec2f* uv) const {
+    const int *v = &indices[3*t];
+    if(!uvs.empty()) for(int k = 0; k < 3; k++) uv[k] = uvs[v[k]];
+    else if(textured){
+      const Vec3f *p[3] = {&positions[v[0]], &positions[v[1]], &positions[v[2]]};
+      bboxUV(p, uv);
+    }
+    else uv[0] = uv[1] = uv[2] = Vec2f();
+  }
+  // view_projection je projekcija*pogled kamere
+  const vector<Vertex>& process(const Matrix& view_projection, const Viewport& view, bool textured = false){
+    cache.transform(view_projection*transform, positions, view, clipper.guard);
+    screen.clear();
+    for(int t = 0; t < triangles(); t++){
+      const int *v = &indices[3*t];
+      if(cache.view_code[v[0]] & cache.view_code[v[1]] & cache.view_code[v[2]]) continue;
+      int mask = cache.guard_code[v[0]] | cache.guard_code[v[1]] | cache.guard_code[v[2]];
+      Vec2f uv[3];
+      corner_uvs(t, textured, uv);
+      if(!mask){
+        Vertex a = cache.screen_vertex(v[0], uv[0]), b = cache.screen_vertex(v[1], uv[1]), c = cache.screen_vertex(v[2], uv[2]);
+        if(culled(a, b, c)) continue;
+        screen.push_back(a); screen.push_back(b); screen.push_back(c);
+        continue;
+      }
+      // rezani trokut je lepeza u istoj ravnini, svaki njen trokut se provjerava posebno
+      size_t first = screen.size(), kept = first;
+      clipper.clip(cache.clip_vertex(v[0], uv[0]), cache.clip_vertex(v[1], uv[1]), cache.clip_vertex(v[2], uv[2]), mask, view, screen);
+      for(size_t i = first; i < screen.size(); i += 3){
+        if(culled(screen[i], screen[i+1], screen[i+2])) continue;
+        for(int k = 0; k < 3; k++) screen[kept++] = screen[i+k];
       }
+      screen.resize(kept);
+    }
+    return screen;
+  }
+  void draw(TGAImage& img, DepthBuffer& depth, const Matrix& view_projection, const Viewport& view, Texture* txt = nullptr) {
+    const vector<Vertex>& v = process(view_projection, view, txt != nullptr);
+    for(size_t i = 0; i < v.size(); i += 3){
+      triangle(v[i], v[i+1], v[i+2], img, depth, color, txt);
+    }
+  }
+  void draw(TileRenderer& renderer, const Matrix& view_projection, const Viewport& view, Texture* txt = nullptr) {
+    const vector<Vertex>& v = process(view_projection, view, txt != nullptr);
+    for(size_t i = 0; i < v.size(); i += 3){
+      renderer.add(v[i], v[i+1], v[i+2], color, txt);
     }
   }
 };
 
 int main() {
   TGAImage image(width, height, TGAImage::RGB);
+  TileRenderer renderer(width, height);
 
   Texture txt("texture.tga");
 
-  Model tetrahedron("tetrahedron.obj", 0.3, Vec3f(0, 0, 1), red);
-  Model octahedron("octahedron.obj", 0.2, Vec3f(400, 400, 0.25), blue);
+  // modeli su zadani u pikselima ekrana, kamera je 5 jedinica ispred njih i gleda prema -z
+  Model tetrahedron("tetrahedron.obj", Matrix::translate(Vec3f(0, 0, 1))*Matrix::scale(Vec3f(0.3*width, 0.3*height, 1)), red);
+  Model octahedron("octahedron.obj", Matrix::translate(Vec3f(400, 400, 0.25))*Matrix::scale(Vec3f(0.2*width, 0.2*height, 1)), blue);
 
-  vector<Model*> models = {&tetrahedron, &octahedron};
-
-  // trebam popravit clipping
-  /*Plane near(Vec3f(0, 0, 1), 0);
-  Plane left(Vec3f(1, 0, 0), 0);
-  Plane right(Vec3f(-1, 0, 0), -width);
-  Plane top(Vec3f(0, -1, 0), -height);
-  Plane bottom(Vec3f(0, 1, 0), 0);
-  Plane far(Vec3f(0, 0, -1), -1);
-
-  vector<Plane*> clippingPlanes = { &near, &left, &right, &top, &bottom, &far };
-  
-  for(auto m:models){
-    m->clip(clippingPlanes);
-  }*/
+  Matrix camera = Matrix::look_at(Vec3f(0, 0, 5), Vec3f(0, 0, 0), Vec3f(0, 1, 0));
+  Matrix projection = Matrix::ortho(0, width, 0, height, 1, 7);
+  Viewport view(width, height);
+  // tekstura se cita samo za vidljive piksele
+  renderer.deferred = true;
 
-  tetrahedron.draw(image);
-  octahedron.draw(image, &txt);
+  tetrahedron.draw(renderer, projection*camera, view);
+  octahedron.draw(renderer, projection*camera, view, &txt);
+  renderer.render(image);
   
   image.flip_vertically();
   image.write_tga_file("slika.tga");
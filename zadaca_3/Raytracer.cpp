@@ -3,16 +3,92 @@
 #include <vector>
 #include <cmath>
 #include <limits>
+#include <deque>
+#include <cstring>
+#include <mutex>
+#include <chrono>
+#include <stdexcept>
+#include <memory>
+#include <type_traits>
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <cerrno>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAY_SSE
+#endif
 #include "geometry.h"
+#include "sampler.h"
+#include "denoiser.h"
+#include "hdr.h"
+#include "arena.h"
+#include "obj_parser.h"
+#include "bvh.h"
+#include "mesh_cache.h"
 
 #define M_PI 3.14159265358979323846
 
 using namespace std;
 
+// brojac alokacija na heapu po dretvi, render() ga koristi da provjeri da renderiranje tileova ne alocira
+thread_local long long heap_allocations = 0;
+
+// noinline: inace GCC nakon inlineanja vidi free() na pokazivacu iz new i lazno upozorava
+__attribute__((noinline)) void* operator new(size_t size) {
+  heap_allocations++;
+  if(void *p = malloc(size ? size : 1)) return p;
+  throw bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Binarni zapis scene, kamere i svjetala za workere RenderFarma. Pise se polje po polje (brojevi u
+// poretku bajtova procesora), pa format ne ovisi o rasporedu struktura u memoriji
+struct ByteWriter {
+  vector<char> bytes;
+  template <typename T> void put(const T &v) {
+    static_assert(is_arithmetic<T>::value, "ByteWriter: samo brojevi");
+    bytes.insert(bytes.end(), (const char*)&v, (const char*)&v + sizeof(v));
+  }
+  void put(const Vec2f &v) { put(v.x); put(v.y); }
+  void put(const Vec3f &v) { put(v.x); put(v.y); put(v.z); }
+  void put(const string &s) { put((int)s.size()); bytes.insert(bytes.end(), s.begin(), s.end()); }
+};
+
+// cita zapis iz ByteWritera; ako zapisa nestane ok postaje false, a ostale vrijednosti su nule
+struct ByteReader {
+  const char *p, *end;
+  bool ok = true;
+  ByteReader(const vector<char> &bytes) : p(bytes.data()), end(bytes.data() + bytes.size()) {}
+  template <typename T> void get(T &v) {
+    static_assert(is_arithmetic<T>::value, "ByteReader: samo brojevi");
+    v = T();
+    if(end - p < (ptrdiff_t)sizeof(T)) { ok = false; return; }
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+  }
+  void get(Vec2f &v) { get(v.x); get(v.y); }
+  void get(Vec3f &v) { get(v.x); get(v.y); get(v.z); }
+  void get(string &s) {
+    int n;
+    get(n);
+    if(n < 0 || end - p < n) { ok = false; n = 0; }
+    s.assign(p, n);
+    p += n;
+  }
+};
+
 struct Environment{
+  string filename;
   vector<Vec3f> img;
   int r, width, height, range;
-  Environment(const string& filename, const float& r, const int& width, const int& height): r(r), width(width), height(height) {
+  vector<vector<Vec3f>> mips; // mips[0] je img, svaka sljedeca razina je 2x2 prosjek prethodne
+  vector<int> mip_width, mip_height;
+  Environment(const string& filename, const float& r, const int& width, const int& height): filename(filename), r(r), width(width), height(height) {
     ifstream file(filename, ifstream::binary);
     file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
     file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
@@ -20,8 +96,45 @@ struct Environment{
     vector<unsigned char> buffer(istreambuf_iterator<char>(file), {});
     for(int i = 0; i < buffer.size(); i+=3) img.push_back(Vec3f((float)buffer[i]/255, (float)buffer[i+1]/255, (float)buffer[i+2]/255));
     file.close();
+    img.resize(width*height);
+    build_mips();
+  }
+  // workeri ucitavaju istu datoteku
+  void write(ByteWriter &out) const { out.put(filename); out.put(r); out.put(width); out.put(height); }
+  void build_mips() {
+    mips = { img };
+    mip_width = { width };
+    mip_height = { height };
+    while(mip_width.back() > 1 || mip_height.back() > 1){
+      const vector<Vec3f> &src = mips.back();
+      int sw = mip_width.back(), sh = mip_height.back();
+      int w = max(1, sw/2), h = max(1, sh/2);
+      vector<Vec3f> dst(w*h);
+      for(int j = 0; j < h; j++){
+        for(int i = 0; i < w; i++){
+          int i0 = min(2*i, sw - 1), i1 = min(2*i + 1, sw - 1), j0 = min(2*j, sh - 1), j1 = min(2*j + 1, sh - 1);
+          dst[j*w + i] = (src[j0*sw + i0] + src[j0*sw + i1] + src[j1*sw + i0] + src[j1*sw + i1])*0.25f;
+        }
+      }
+      mips.push_back(dst);
+      mip_width.push_back(w);
+      mip_height.push_back(h);
+    }
+  }
+  // bilinearno na razini level, u se ponavlja (sav), v se odsijeca na polovima
+  Vec3f bilinear(int level, float u, float v) const {
+    int w = mip_width[level], h = mip_height[level];
+    const vector<Vec3f> &m = mips[level];
+    float x = u*w - 0.5f, y = v*h - 0.5f;
+    int i0 = floor(x), j0 = floor(y);
+    float fx = x - i0, fy = y - j0;
+    int i1 = i0 + 1, j1 = min(h - 1, max(0, j0 + 1));
+    i0 = (i0 % w + w) % w; i1 = (i1 % w + w) % w;
+    j0 = min(h - 1, max(0, j0));
+    return (m[j0*w + i0]*(1 - fx) + m[j0*w + i1]*fx)*(1 - fy) + (m[j1*w + i0]*(1 - fx) + m[j1*w + i1]*fx)*fy;
   }
-  Vec3f map(const Vec3f& orig, const Vec3f& dir) const {
+  // spread je kut otvora zrake (ray cone), prema njemu se bira mip razina i interpolira izmedju dvije
+  Vec3f map(const Vec3f& orig, const Vec3f& dir, const float& spread = 0) const {
     /*Vec3f a = orig + dir*((dir*(-orig))/(dir.norm()));
     float dist = ((-orig)*(-orig) > r*r) ? (a - orig).norm() - sqrt(r*r - (-a) * (-a)) : (a - orig).norm() + sqrt(r*r - (-a) * (-a));
     Vec3f d = orig + dir*dist;
@@ -29,25 +142,49 @@ struct Environment{
     // Kad racunam pomocu ovog gore ^, file mi se ne ispise iako sam pomocu cout-a provjerio i radi
     Vec3f d = dir;
     float u = 0.5 + 0.5*atan2(d[0], d[2])/M_PI;
-    float v = 0.5 - asin(d[1])/M_PI;
-    int i = floor(u*width);
-    int j = floor(v*height);
-    return img[j*width + i];
+    float v = 0.5 - asin(max(-1.f, min(1.f, d[1])))/M_PI;
+    float lod = spread > 0 ? log2(spread*width/(2*M_PI)) : 0; // texel na razini 0 pokriva 2pi/width radijana
+    lod = max(0.f, min(lod, (float)mips.size() - 1));
+    int l0 = floor(lod), l1 = min(l0 + 1, (int)mips.size() - 1);
+    float f = lod - l0;
+    if(f == 0) return bilinear(l0, u, v);
+    return bilinear(l0, u, v)*(1 - f) + bilinear(l1, u, v)*f;
   }
 };
 
 struct Light{
   Vec3f position;
   float intensity;
-  Light(const Vec3f& position, const float& intensity) : position(position), intensity(intensity) {}
+  float radius; // 0 je tockasto svjetlo, inace sfera
+  int samples;  // broj zraka sjene po pogotku za sferno svjetlo
+  Light(const Vec3f& position, const float& intensity, const float& radius = 0, const int& samples = 1) : position(position), intensity(intensity), radius(radius), samples(radius > 0 ? samples : 1) {
+    if(this->samples < 1) throw invalid_argument("Light: broj uzoraka mora biti pozitivan");
+  }
+  void write(ByteWriter &out) const { out.put(position); out.put(intensity); out.put(radius); out.put(samples); }
+  void read(ByteReader &in) {
+    in.get(position); in.get(intensity); in.get(radius); in.get(samples);
+    if(samples < 1) in.ok = false;
+  }
+};
+
+struct RayStats {
+  long long primary = 0, secondary = 0, shadow = 0;
+  void add(const RayStats& o) { primary += o.primary; secondary += o.secondary; shadow += o.shadow; }
 };
 
+thread_local RayStats ray_stats;
+
 struct Camera{
+  enum Projection { PERSPECTIVE, ORTHOGRAPHIC, FISHEYE, THIN_LENS };
   Vec3f pos;
   Vec3f dir;
   float roll;
   Vec3f dir_up;
   Vec3f dir_right;
+  Projection projection = PERSPECTIVE;
+  float ortho_size = 10;  // ORTHOGRAPHIC: visina slike u jedinicama scene
+  float aperture = 0;     // THIN_LENS: radijus lece
+  float focus_dist = 1;   // THIN_LENS: udaljenost ravnine fokusa duz dir
   Camera(const Vec3f& pos, const Vec3f& dir, const float& roll): pos(pos), dir(dir), roll(M_PI*2*roll/360) {
     this->dir.normalize();
     dir_up = Vec3f(2, 0, 0);
@@ -56,17 +193,230 @@ struct Camera{
     dir_up.normalize();
     dir_right.normalize();
   }
+  // zapisuju se i izvedeni vektori, pa worker ima bit-identicnu kameru
+  void write(ByteWriter &out) const {
+    out.put(pos); out.put(dir); out.put(roll); out.put(dir_up); out.put(dir_right);
+    out.put((int)projection); out.put(ortho_size); out.put(aperture); out.put(focus_dist);
+  }
+  void read(ByteReader &in) {
+    int p;
+    in.get(pos); in.get(dir); in.get(roll); in.get(dir_up); in.get(dir_right);
+    in.get(p); in.get(ortho_size); in.get(aperture); in.get(focus_dist);
+    if(p < PERSPECTIVE || p > THIN_LENS) in.ok = false;
+    projection = (Projection)p;
+  }
 };
 
 struct Viewport{
   float nx;
   float ny;
   float fov; // vertikalni
-  Viewport(const float& nx, const float& ny, const float& fov): nx(nx), ny(ny), fov(fov) {}
+  int spp; // uzoraka po pikselu
+  uint32_t seed;
+  Viewport(const float& nx, const float& ny, const float& fov, const int& spp = 1, const uint32_t& seed = 0): nx(nx), ny(ny), fov(fov), spp(spp), seed(seed) {}
+  void write(ByteWriter &out) const { out.put(nx); out.put(ny); out.put(fov); out.put(spp); out.put(seed); }
+  void read(ByteReader &in) {
+    in.get(nx); in.get(ny); in.get(fov); in.get(spp); in.get(seed);
+    if(!(nx >= 1 && ny >= 1 && nx*ny <= 1e8f && spp >= 1)) in.ok = false;
+  }
 };
 
 typedef vector<Light> Lights;
 
+// Izotropni ray differential (ray cone): sirina otiska zrake u ishodistu i kut sirenja.
+// Za primarne zrake kut je kut piksela, na zakrivljenoj plohi refleksija ga povecava.
+struct RayCone {
+  float width;
+  float spread;
+  RayCone(const float& width = 0, const float& spread = 0) : width(width), spread(spread) {}
+  float width_at(float t) const { return width + spread*t; }
+};
+
+// zrake kamere za jedan red piksela, SoA da se petlje po x vektoriziraju; memorija je iz arene
+struct CameraRays {
+  float *ox, *oy, *oz, *dx, *dy, *dz;
+  int size;
+  CameraRays(Arena& arena, int n) : size(n) {
+    ox = arena.alloc<float>(n); oy = arena.alloc<float>(n); oz = arena.alloc<float>(n);
+    dx = arena.alloc<float>(n); dy = arena.alloc<float>(n); dz = arena.alloc<float>(n);
+  }
+  Vec3f orig(int i) const { return Vec3f(ox[i], oy[i], oz[i]); }
+  Vec3f dir(int i) const { return Vec3f(dx[i], dy[i], dz[i]); }
+};
+
+// baza kamere s vec ukljucenim roll-om, racuna se jednom po slici
+#ifdef RAY_SSE
+// sin i cos za 4 kuta (Cephes sinf/cosf): svodenje na [-pi/4, pi/4] po oktantima i polinomi,
+// greska nekoliko ulp-ova
+inline void sincos_ps(__m128 x, __m128 &s, __m128 &c) {
+  const __m128 sign_mask = _mm_set1_ps(-0.f);
+  __m128 sign_sin = _mm_and_ps(x, sign_mask);
+  x = _mm_andnot_ps(sign_mask, x);
+  __m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.27323954473516f))); // 4/pi
+  j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+  __m128 y = _mm_cvtepi32_ps(j);
+  __m128 swap_sin = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29));
+  __m128 poly_sin = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128()));
+  __m128 sign_cos = _mm_castsi128_ps(_mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29));
+  sign_sin = _mm_xor_ps(sign_sin, swap_sin);
+  x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+  __m128 z = _mm_mul_ps(x, x);
+  __m128 pc = _mm_set1_ps(2.443315711809948e-5f);
+  pc = _mm_add_ps(_mm_mul_ps(pc, z), _mm_set1_ps(-1.388731625493765e-3f));
+  pc = _mm_add_ps(_mm_mul_ps(pc, z), _mm_set1_ps(4.166664568298827e-2f));
+  pc = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(pc, z), z), _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1.f));
+  __m128 ps = _mm_set1_ps(-1.9515295891e-4f);
+  ps = _mm_add_ps(_mm_mul_ps(ps, z), _mm_set1_ps(8.3321608736e-3f));
+  ps = _mm_add_ps(_mm_mul_ps(ps, z), _mm_set1_ps(-1.6666654611e-1f));
+  ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps, z), x), x);
+  s = _mm_xor_ps(_mm_or_ps(_mm_and_ps(poly_sin, ps), _mm_andnot_ps(poly_sin, pc)), sign_sin);
+  c = _mm_xor_ps(_mm_or_ps(_mm_and_ps(poly_sin, pc), _mm_andnot_ps(poly_sin, ps)), sign_cos);
+}
+#endif
+
+struct RayGenerator {
+  Camera::Projection projection;
+  Vec3f pos, forward, up, right;
+  float cam_dist, half_x, half_y;
+  float fov, ortho_scale, aperture, focus_dist;
+
+  RayGenerator(const Camera& cam, const Viewport& view) : projection(cam.projection), pos(cam.pos), forward(cam.dir), fov(view.fov), aperture(cam.aperture), focus_dist(cam.focus_dist) {
+    float c = cos(cam.roll), s = sin(cam.roll);
+    up = cam.dir_up*c + cross(cam.dir, cam.dir_up)*s; //Rodrigues rotation, os je okomita na bazu
+    right = cam.dir_right*c + cross(cam.dir, cam.dir_right)*s;
+    half_x = view.nx*0.5;
+    half_y = view.ny*0.5;
+    cam_dist = half_x/(tan(view.fov/2.));
+    ortho_scale = cam.ortho_size/view.ny;
+  }
+
+  // ray differential primarne zrake: kut koji pokriva jedan piksel (za ORTHOGRAPHIC sirina piksela)
+  RayCone pixel_cone() const {
+    switch(projection){
+    case Camera::ORTHOGRAPHIC: return RayCone(ortho_scale, 0);
+    case Camera::FISHEYE: return RayCone(0, fov*0.5f/half_y);
+    default: return RayCone(0, 1/cam_dist);
+    }
+  }
+
+  // inverz generate_row za PERSPECTIVE: koordinate piksela u kojem se vidi tocka p
+  bool project(const Vec3f& p, float& px, float& py) const {
+    if(projection != Camera::PERSPECTIVE) return false;
+    Vec3f v = p - pos;
+    float z = v*forward;
+    if(z <= 0) return false;
+    px = (v*up)*cam_dist/z + half_x;
+    py = (v*right)*cam_dist/z + half_y;
+    return true;
+  }
+
+  // zrake za piksele (x0 .. x0+n-1, y); jitter je pomak unutar piksela, lens uzorak na [0,1)^2 za THIN_LENS
+  void generate_row(int y, int x0, int n, const Vec2f *jitter, const Vec2f *lens, CameraRays &out) const {
+    float *ox = out.ox, *oy = out.oy, *oz = out.oz;
+    float *dx = out.dx, *dy = out.dy, *dz = out.dz;
+    int i = 0;
+#ifdef RAY_SSE
+    // petlje po 4 zrake, ostatak reda ide skalarno; redoslijed operacija je isti kao u skalarnim
+    const __m128 upx = _mm_set1_ps(up.x), upy = _mm_set1_ps(up.y), upz = _mm_set1_ps(up.z);
+    const __m128 rx = _mm_set1_ps(right.x), ry = _mm_set1_ps(right.y), rz = _mm_set1_ps(right.z);
+    const __m128 hx = _mm_set1_ps(half_x), half = _mm_set1_ps(0.5f);
+    const __m128 px0 = _mm_set_ps(3, 2, 1, 0);
+    for(; i + 4 <= n; i += 4){
+      __m128 j01 = _mm_loadu_ps(&jitter[i].x), j23 = _mm_loadu_ps(&jitter[i + 2].x);
+      __m128 jx = _mm_shuffle_ps(j01, j23, _MM_SHUFFLE(2, 0, 2, 0)), jy = _mm_shuffle_ps(j01, j23, _MM_SHUFFLE(3, 1, 3, 1));
+      __m128 px = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps((float)(x0 + i)), px0), jx), half), hx);
+      __m128 py = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_set1_ps((float)y), jy), half), _mm_set1_ps(half_y));
+      _mm_storeu_ps(dx + i, _mm_add_ps(_mm_mul_ps(upx, px), _mm_mul_ps(rx, py)));
+      _mm_storeu_ps(dy + i, _mm_add_ps(_mm_mul_ps(upy, px), _mm_mul_ps(ry, py)));
+      _mm_storeu_ps(dz + i, _mm_add_ps(_mm_mul_ps(upz, px), _mm_mul_ps(rz, py)));
+    }
+    const __m128 pos_x = _mm_set1_ps(pos.x), pos_y = _mm_set1_ps(pos.y), pos_z = _mm_set1_ps(pos.z);
+    const __m128 fx = _mm_set1_ps(forward.x), fy = _mm_set1_ps(forward.y), fz = _mm_set1_ps(forward.z);
+#endif
+    for(; i < n; i++){
+      float px = x0 + i + jitter[i].x - 0.5f - half_x;
+      float py = y + jitter[i].y - 0.5f - half_y;
+      dx[i] = up.x*px + right.x*py;
+      dy[i] = up.y*px + right.y*py;
+      dz[i] = up.z*px + right.z*py;
+    }
+    switch(projection){
+    case Camera::ORTHOGRAPHIC:
+      i = 0;
+#ifdef RAY_SSE
+      for(const __m128 scale = _mm_set1_ps(ortho_scale); i + 4 <= n; i += 4){
+        _mm_storeu_ps(ox + i, _mm_add_ps(pos_x, _mm_mul_ps(_mm_loadu_ps(dx + i), scale)));
+        _mm_storeu_ps(oy + i, _mm_add_ps(pos_y, _mm_mul_ps(_mm_loadu_ps(dy + i), scale)));
+        _mm_storeu_ps(oz + i, _mm_add_ps(pos_z, _mm_mul_ps(_mm_loadu_ps(dz + i), scale)));
+        _mm_storeu_ps(dx + i, fx); _mm_storeu_ps(dy + i, fy); _mm_storeu_ps(dz + i, fz);
+      }
+#endif
+      for(; i < n; i++){
+        ox[i] = pos.x + dx[i]*ortho_scale; oy[i] = pos.y + dy[i]*ortho_scale; oz[i] = pos.z + dz[i]*ortho_scale;
+        dx[i] = forward.x; dy[i] = forward.y; dz[i] = forward.z;
+      }
+      return;
+    case Camera::FISHEYE: // ekvidistantna, fov vrijedi za visinu slike
+      i = 0;
+#ifdef RAY_SSE
+      for(const __m128 angle = _mm_set1_ps(fov*0.5f/half_y); i + 4 <= n; i += 4){
+        __m128 x = _mm_loadu_ps(dx + i), y = _mm_loadu_ps(dy + i), z = _mm_loadu_ps(dz + i);
+        __m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+        __m128 s, c;
+        sincos_ps(_mm_mul_ps(r, angle), s, c);
+        // r = 0 samo u sredistu slike, tamo je k = 0 umjesto 0/0
+        __m128 k = _mm_and_ps(_mm_cmpgt_ps(r, _mm_setzero_ps()), _mm_div_ps(s, r));
+        _mm_storeu_ps(dx + i, _mm_add_ps(_mm_mul_ps(fx, c), _mm_mul_ps(x, k)));
+        _mm_storeu_ps(dy + i, _mm_add_ps(_mm_mul_ps(fy, c), _mm_mul_ps(y, k)));
+        _mm_storeu_ps(dz + i, _mm_add_ps(_mm_mul_ps(fz, c), _mm_mul_ps(z, k)));
+        _mm_storeu_ps(ox + i, pos_x); _mm_storeu_ps(oy + i, pos_y); _mm_storeu_ps(oz + i, pos_z);
+      }
+#endif
+      for(; i < n; i++){
+        float r = sqrt(dx[i]*dx[i] + dy[i]*dy[i] + dz[i]*dz[i]);
+        float theta = r/half_y*fov*0.5f;
+        float k = r > 0 ? sin(theta)/r : 0;
+        dx[i] = forward.x*cos(theta) + dx[i]*k;
+        dy[i] = forward.y*cos(theta) + dy[i]*k;
+        dz[i] = forward.z*cos(theta) + dz[i]*k;
+        ox[i] = pos.x; oy[i] = pos.y; oz[i] = pos.z;
+      }
+      return;
+    default:
+      break;
+    }
+    i = 0;
+#ifdef RAY_SSE
+    const __m128 cx = _mm_set1_ps(forward.x*cam_dist), cy = _mm_set1_ps(forward.y*cam_dist), cz = _mm_set1_ps(forward.z*cam_dist);
+    for(; i + 4 <= n; i += 4){
+      __m128 x = _mm_add_ps(cx, _mm_loadu_ps(dx + i)), y = _mm_add_ps(cy, _mm_loadu_ps(dy + i)), z = _mm_add_ps(cz, _mm_loadu_ps(dz + i));
+      __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z))));
+      _mm_storeu_ps(dx + i, _mm_mul_ps(x, inv)); _mm_storeu_ps(dy + i, _mm_mul_ps(y, inv)); _mm_storeu_ps(dz + i, _mm_mul_ps(z, inv));
+      _mm_storeu_ps(ox + i, pos_x); _mm_storeu_ps(oy + i, pos_y); _mm_storeu_ps(oz + i, pos_z);
+    }
+#endif
+    for(; i < n; i++){
+      float x = forward.x*cam_dist + dx[i], y = forward.y*cam_dist + dy[i], z = forward.z*cam_dist + dz[i];
+      float inv = 1.f/sqrt(x*x + y*y + z*z);
+      dx[i] = x*inv; dy[i] = y*inv; dz[i] = z*inv;
+      ox[i] = pos.x; oy[i] = pos.y; oz[i] = pos.z;
+    }
+    if(projection == Camera::THIN_LENS){
+      for(i = 0; i < n; i++){
+        Vec3f d = out.dir(i);
+        Vec3f focus = pos + d*(focus_dist/(d*forward));
+        Vec2f disk = concentric_disk(2*lens[i].x - 1, 2*lens[i].y - 1);
+        Vec3f o = pos + (up*disk.x + right*disk.y)*aperture;
+        d = (focus - o).normalize();
+        ox[i] = o.x; oy[i] = o.y; oz[i] = o.z;
+        dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+      }
+    }
+  }
+};
+
 struct Material {
   Vec2f albedo;
   Vec3f diffuse_color;
@@ -75,85 +425,239 @@ struct Material {
   float alpha;
 
   Material(const Vec2f &a, const Vec3f &color, const float &coef, const float &refind, const float &alpha) : albedo(a), diffuse_color(color), specular_exponent(coef), refraction_index(refind), alpha(alpha) {}
-  Material() : albedo(Vec2f(1, 0)), diffuse_color(), specular_exponent(1.f) {}
+  Material() : albedo(Vec2f(1, 0)), diffuse_color(), specular_exponent(1.f), refraction_index(1), alpha(1) {}
+  void write(ByteWriter &out) const { out.put(albedo); out.put(diffuse_color); out.put(specular_exponent); out.put(refraction_index); out.put(alpha); }
+  void read(ByteReader &in) { in.get(albedo); in.get(diffuse_color); in.get(specular_exponent); in.get(refraction_index); in.get(alpha); }
+};
+
+// podaci o pogotku koje ray_intersect zna, a shade ih koristi (npr. trokut i baricentricne koordinate)
+struct SurfaceHit {
+  int prim = -1;
+  float u = 0, v = 0;
+  Vec3f normal;
+  Vec2f uv;
 };
 
 struct Object {
+  enum Type { SPHERE, CUBOID, CYLINDER, MODEL };
   Material material;
-  virtual bool ray_intersect(const Vec3f &p, const Vec3f &d, float &t) const = 0;
+  virtual ~Object() {}
+  // tip, parametri i materijal za workere, vidi read_object
+  virtual void write(ByteWriter &out) const = 0;
+  virtual bool ray_intersect(const Ray &ray, float &t, SurfaceHit *hit = nullptr) const = 0;
+  // any-hit upit za zrake sjene: postoji li pogodak blizi od tmax
+  virtual bool occluded(const Ray &ray, float tmax) const {
+    float t = tmax;
+    return ray_intersect(ray, t) && t < tmax;
+  }
   virtual Vec3f normal(const Vec3f &p) const = 0;    
+  virtual float curvature(const Vec3f &p) const { return 0; } // 1/radijus, za sirenje reflektiranih zraka
+  // normala i UV u tocki pogotka p; hit dolazi iz ray_intersect
+  virtual void shade(const Vec3f &p, SurfaceHit &hit) const { hit.normal = normal(p); hit.uv = Vec2f(); }
 };
 
 typedef std::vector<Object*> Objects;
 
+// smooth racuna normale vrhova ako ih OBJ nema, inace se bez vn koriste normale trokuta;
+// quality bira izmedu brze LBVH gradnje i SAH-a, compact sprema siroko kvantizirano stablo (QBVH)
+// koje zauzima oko trecine memorije binarnog; memory_limit > 0 ukljucuje out-of-core nacin u kojem
+// se klasteri trokuta ucitavaju po potrebi, a cijeli blob (mapirani vrhovi, plohe i stablo zajedno s
+// ucitanim klasterima) drzi najvise toliko bajtova. Ako ne stane ni jedan klaster po dretvi, Model
+// baca invalid_argument
+struct MeshSettings {
+  bool smooth = false;
+  BVH::Quality quality = BVH::BALANCED;
+  bool compact = false;
+  size_t memory_limit = 0;
+};
+
 struct Model : Object {
   struct face {
     int v0, v1, v2;
   };
-  vector<Vec3f> vertices;
-  vector<face> faces;
+  // pokazivaci u blob (mapiranu datoteku cachea ili tek izgradenu mrezu)
+  const Vec3f *vertices = nullptr;
+  const Vec3f *normals = nullptr; // po vrhu, nullptr za ravne plohe
+  const Vec2f *uvs = nullptr;     // po vrhu, nullptr ako ih OBJ nema
+  const face *faces = nullptr;    // poredani po listovima BVH-a
+  const float *tri = nullptr;     // klasteri SoA v0, e1, e2 za presjek, nullptr u out-of-core nacinu
+  const BVHNode *nodes = nullptr;
+  const QBVHNode *wide_nodes = nullptr; // umjesto nodes ako je mreza kompaktna
+  int triangles = 0;
+  MeshBlob blob;
+  mutable ClusterCache clusters;
+  string name;
+  float scale;
+  Vec3f center;
+  MeshSettings settings;
 
-  Model(const string& filename, const float& scale, const Vec3f& center, const Material& m){
+  // Obradena mreza i BVH spremaju se uz OBJ (filename.rtcache) s kljucem iz sadrzaja datoteke i
+  // parametara, pa se iduci put samo mapiraju
+  Model(const string& filename, const float& scale, const Vec3f& center, const Material& m, const MeshSettings& settings = MeshSettings()) : name(filename), scale(scale), center(center), settings(settings) {
+    const bool smooth = settings.smooth, compact = settings.compact;
+    const BVH::Quality quality = settings.quality;
     Object::material = m;
-    ifstream file(filename); //obj file bez headera
-    string s;
-    while(file >> s){
-      if (s[0] == 'v') {
-        float x, y, z;
-        file >> x >> y >> z;
-        vertices.push_back(Vec3f(x*scale, y*scale, z*scale) + center);
-      } else if (s[0] == 'f') {
-        face f;
-        file >> f.v0 >> f.v1 >> f.v2;
-        f.v0--;f.v1--;f.v2--;
-        faces.push_back(f);
-      }
+    auto start = chrono::steady_clock::now();
+    // kljuc je hash sadrzaja i svih parametara koji mijenjaju rezultat
+    const float params[] = {scale, center.x, center.y, center.z, (float)smooth, (float)quality, (float)compact, (float)sizeof(BVHNode)};
+    uint64_t key = 0;
+    if(!hash_file(filename, hash_bytes(params, sizeof(params)), key)) cerr << "ne mogu ucitati " << filename << endl;
+    string cache = filename + ".rtcache";
+
+    bool cached = blob.open(cache, key);
+    double build_ms = 0;
+    if(!cached){
+      string source;
+      read_file(filename, source);
+      ObjMesh mesh;
+      if(!parse_obj(source, mesh)) cerr << "neispravan OBJ " << filename << endl;
+      if(smooth && mesh.normals.empty()) mesh.compute_normals();
+      for(auto &v:mesh.positions) v = v*scale + center;
+
+      vector<AABB> boxes(mesh.triangles());
+      for(size_t i = 0; i < boxes.size(); i++)
+        for(int k = 0; k < 3; k++) boxes[i].expand(mesh.positions[mesh.indices[3*i + k]]);
+      BVH bvh;
+      bvh.build(boxes, quality);
+      build_ms = bvh.stats.build_ms;
+      vector<int> ordered;
+      ordered.reserve(mesh.indices.size());
+      for(int p:bvh.prims) ordered.insert(ordered.end(), &mesh.indices[3*p], &mesh.indices[3*p] + 3);
+      QBVH wide;
+      if(compact) wide.build(bvh);
+      blob.pack(key, mesh.positions, mesh.normals, mesh.uvs, ordered, bvh, compact ? &wide : nullptr);
+      if(!blob.save(cache)) cerr << "ne mogu spremiti " << cache << endl;
+      // out-of-core radi nad datotekom, izgradena kopija se ne drzi u memoriji
+      else if(settings.memory_limit > 0) blob.open(cache, key);
     }
-    file.close();
+
+    const MeshCacheHeader &h = blob.header();
+    vertices = blob.section<Vec3f>(MeshCacheHeader::POSITIONS);
+    normals = blob.section<Vec3f>(MeshCacheHeader::NORMALS);
+    uvs = blob.section<Vec2f>(MeshCacheHeader::UVS);
+    faces = blob.section<face>(MeshCacheHeader::FACES);
+    tri = blob.section<float>(MeshCacheHeader::TRIANGLES);
+    nodes = blob.section<BVHNode>(MeshCacheHeader::NODES);
+    wide_nodes = blob.section<QBVHNode>(MeshCacheHeader::WIDE_NODES);
+    triangles = h.triangles;
+    if(settings.memory_limit > 0 && triangles > 0){
+      // ostatak bloba (vrhovi, plohe, stablo) je mapiran cijeli, pa za klastere ostaje razlika
+      size_t cluster_bytes = MeshCacheHeader::clusters(triangles)*MeshCacheHeader::cluster_bytes;
+      size_t rest = h.size - cluster_bytes;
+      size_t budget = settings.memory_limit > rest ? settings.memory_limit - rest : 0;
+      if(clusters.open(cache, h.offset[MeshCacheHeader::TRIANGLES], MeshCacheHeader::clusters(triangles), budget)) tri = nullptr;
+      else cerr << "out-of-core nacin nije dostupan za " << cache << endl;
+    }
+
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << filename << ": " << triangles << " triangles, " << h.nodes << " BVH nodes, depth " << h.depth
+         << ", SAH cost " << h.sah_cost;
+    if(wide_nodes) cout << ", " << h.wide_nodes << " wide nodes (" << h.wide_nodes*sizeof(QBVHNode)/1024 << " KB)";
+    else cout << " (" << h.nodes*sizeof(BVHNode)/1024 << " KB)";
+    if(!tri) cout << ", out-of-core with " << settings.memory_limit/1024 << " KB";
+    if(cached) cout << ", mapped from cache in " << ms << " ms" << endl;
+    else cout << ", loaded in " << ms << " ms (BVH " << build_ms << " ms)" << endl;
   }
+
   Vec3f normal(const Vec3f &p) const {
-    for(auto face:faces){
+    for(int i = 0; i < triangles; i++){
+      const face &face = faces[i];
       Vec3f v0 = vertices[face.v0], v1 = vertices[face.v1], v2 = vertices[face.v2];
       float S1 = (cross(v1-p, v2-p)).norm()/2;
       float S2 = (cross(v2-p, v0-p)).norm()/2;
       float S3 = (cross(v0-p, v1-p)).norm()/2;
       float S = (cross(v1 - v0, v2 - v0)).norm()/2;
-      float a = S1/S;
-      float b = S2/S;
-      float c = S3/S;
-      if(0 <= a && b <= 1 && c <= 1) return cross(v1 - v0, v2 - v0).normalize();
+      if(abs(S1 + S2 + S3 - S) < 0.0001*S) return cross(v1 - v0, v2 - v0).normalize();
     }
+    return Vec3f(0, 1, 0);
+  }
+
+  // worker ponovno mapira isti cache (ili gradi mrezu iz OBJ-a), pa datoteke moraju biti dostupne
+  void write(ByteWriter &out) const {
+    out.put((int)MODEL); out.put(name); out.put(scale); out.put(center);
+    out.put((int)settings.smooth); out.put((int)settings.quality); out.put((int)settings.compact); out.put((uint64_t)settings.memory_limit);
+    material.write(out);
+  }
+
+  // interpolacija normala i UV-ova baricentricnim koordinatama iz ray_intersect
+  void shade(const Vec3f &p, SurfaceHit &hit) const {
+    if(hit.prim < 0) { Object::shade(p, hit); return; }
+    const face &f = faces[hit.prim];
+    float w = 1 - hit.u - hit.v;
+    if(!normals) hit.normal = cross(vertices[f.v1] - vertices[f.v0], vertices[f.v2] - vertices[f.v0]).normalize();
+    else hit.normal = (normals[f.v0]*w + normals[f.v1]*hit.u + normals[f.v2]*hit.v).normalize();
+    hit.uv = !uvs ? Vec2f() : uvs[f.v0]*w + uvs[f.v1]*hit.u + uvs[f.v2]*hit.v;
   }
   
-  bool ray_intersect(const Vec3f &p, const Vec3f &d, float &t) const {
-    bool intersected = false;
-    for(auto face:faces){ // moller trumbore algo
-      Vec3f v0 = vertices[face.v0];
-      Vec3f v1 = vertices[face.v1];  
-      Vec3f v2 = vertices[face.v2];
-      Vec3f e1, e2, h, s, q;
-      float a,f,u,v;
-      e1 = v1 - v0;
-      e2 = v2 - v0;
-      h = cross(d, e2);
-      a = e1 * h;
-      if (a > -0.00001 && a < 0.00001) continue;
-      f = 1.0/a;
-      s = p - v0;
-      u = f * (s * h);
-      if (u < 0.0 || u > 1.0) continue;
-      q = cross(s, e1);
-      v = f * (d * q);
-      if (v < 0.0 || u + v > 1.0) continue;
-
-      float temp = f * (e2 * q);
-
-      if (temp > 0.00001) {
-          t = intersected ? min(t, temp) : temp;
-          intersected = true;
-      }
+  void print_residency() const {
+    if(!clusters.active()) return;
+    ClusterCache::Stats st = clusters.statistics();
+    cout << name << ": " << st.page_ins << " cluster page-ins, " << st.hits << " hits, " << st.evictions
+         << " evictions, peak " << st.peak_bytes/1024 << " KB resident" << endl;
+  }
+
+  // moller trumbore nad trokutom j klastera, vraca true i smanjuje t ako je pogodak blizi
+  bool triangle_intersect(const float *cluster, int j, const Ray &ray, float &t, float &u, float &v) const {
+    const Vec3f &p = ray.orig, &d = ray.dir;
+    const int n = MeshCacheHeader::cluster_size;
+    const float *c = cluster + j;
+    Vec3f v0(c[0], c[n], c[2*n]);
+    Vec3f e1(c[3*n], c[4*n], c[5*n]);
+    Vec3f e2(c[6*n], c[7*n], c[8*n]);
+    Vec3f h, s, q;
+    float a,f;
+    h = cross(d, e2);
+    a = e1 * h;
+    if (a > -0.00001 && a < 0.00001) return false;
+    f = 1.0/a;
+    s = p - v0;
+    u = f * (s * h);
+    if (u < 0.0 || u > 1.0) return false;
+    q = cross(s, e1);
+    v = f * (d * q);
+    if (v < 0.0 || u + v > 1.0) return false;
+
+    float temp = f * (e2 * q);
+    if (temp > 0.00001 && temp < t) {
+      t = temp;
+      return true;
     }
-    return intersected;
+    return false;
+  }
+
+  bool ray_intersect(const Ray &ray, float &t, SurfaceHit *hit = nullptr) const {
+    return traverse<false>(ray, t, hit);
+  }
+
+  bool occluded(const Ray &ray, float tmax) const {
+    return traverse<true>(ray, tmax, nullptr);
+  }
+
+  // any: zavrsava na prvom pogotku blizem od t (sjene), inace trazi najblizi i sprema ga u t
+  template <bool any> bool traverse(const Ray &ray, float &t, SurfaceHit *hit) const {
+    if(triangles == 0) return false;
+    // trenutni klaster; u out-of-core nacinu ostaje zakljucan dok obilazak ne prijede na drugi
+    int current = -1;
+    const float *cluster = nullptr;
+    auto leaf = [&](int i, float &best) {
+      int c = i/MeshCacheHeader::cluster_size;
+      if(c != current){
+        if(!tri){
+          if(cluster) clusters.release(current);
+          cluster = clusters.acquire(c);
+        } else cluster = tri + c*MeshCacheHeader::cluster_bytes/sizeof(float);
+        current = c;
+      }
+      float u, v;
+      if(!triangle_intersect(cluster, i%MeshCacheHeader::cluster_size, ray, best, u, v)) return false;
+      if(hit) { hit->prim = i; hit->u = u; hit->v = v; }
+      return true;
+    };
+    bool found;
+    if(any) found = wide_nodes ? qbvh_occluded(wide_nodes, ray, t, leaf) : bvh_occluded(nodes, ray, t, leaf);
+    else found = wide_nodes ? qbvh_intersect(wide_nodes, ray, t, leaf) : bvh_intersect(nodes, ray, t, leaf);
+    if(!tri && cluster) clusters.release(current);
+    return found;
   }
 };
 
@@ -169,7 +673,12 @@ struct Sphere : Object {
     return (p - c).normalize();        
   }
 
-  bool ray_intersect(const Vec3f &p, const Vec3f &d, float &t) const {
+  float curvature(const Vec3f &p) const { return 1/r; }
+
+  void write(ByteWriter &out) const { out.put((int)SPHERE); out.put(c); out.put(r); material.write(out); }
+
+  bool ray_intersect(const Ray &ray, float &t, SurfaceHit *hit = nullptr) const {
+    const Vec3f &p = ray.orig, &d = ray.dir;
     Vec3f v = c - p;
 
     if(v*d < 0) return false;
@@ -192,8 +701,9 @@ struct Sphere : Object {
 
 struct Cuboid : Object {
   Vec3f s, e;
+  AABB box;
 
-  Cuboid(const Vec3f &s, const Vec3f &e, const Material &m) : s(s), e(e) {
+  Cuboid(const Vec3f &s, const Vec3f &e, const Material &m) : s(s), e(e), box(s, e) {
     Object::material = m;
   }
 
@@ -206,43 +716,13 @@ struct Cuboid : Object {
     else if(abs(p[2] - e[2]) < 0.0001) return Vec3f(0,0,1);
   }
 
-  bool ray_intersect(const Vec3f &p, const Vec3f &d, float &t) const {
-    float ts = numeric_limits<float>::min(), tb = numeric_limits<float>::max();
-    float minX = min(s[0], e[0]),
-          minY = min(s[1], e[1]),
-          minZ = min(s[2], e[2]),
-          maxX = max(s[0], e[0]),
-          maxY = max(s[1], e[1]),
-          maxZ = max(s[2], e[2]);
+  void write(ByteWriter &out) const { out.put((int)CUBOID); out.put(s); out.put(e); material.write(out); }
 
-        if (d[0] == 0 && (p[0] < minX || p[0] > maxX)) return false;
-        else {
-          float t1 = (minX - p[0]) / d[0], t2 = (maxX - p[0]) / d[0];
-          if (t1 > t2) swap(t1, t2); 
-          ts = max(ts, t1);
-          tb = min(tb, t2);
-          if (ts > tb || tb < 0) return false;
-        }
-        t = ts;
-        if (d[1] == 0 && (p[1] < minY || p[1] > maxY)) return false;
-        else {
-          float t1 = (minY - p[1]) / d[1], t2 = (maxY - p[1]) / d[1];
-          if (t1 > t2) swap(t1, t2);
-          ts = max(ts, t1);
-          tb = min(tb, t2);
-          if (ts > tb || tb < 0) return false;
-        }
-        t = ts;
-        if (d[2] == 0 && (p[2] < minZ || p[2] > maxZ)) return false;
-        else {
-            float t1 = (minZ - p[2]) / d[2], t2 = (maxZ - p[2]) / d[2];
-            if (t1 > t2) swap(t1, t2);
-            ts = max(ts, t1);
-            tb = min(tb, t2);
-            if (ts > tb || tb < 0) return false;
-        }
-        t = ts;
-        return true;
+  bool ray_intersect(const Ray &ray, float &t, SurfaceHit *hit = nullptr) const {
+    float tnear, tfar;
+    if(!box.ray_intersect(ray, tnear, tfar)) return false;
+    t = tnear > 0 ? tnear : tfar; // ako je pocetak zrake unutra, pogodak je izlaz
+    return true;
   }
 };
 
@@ -261,7 +741,13 @@ struct Cylinder : Object {
     return n;
   }
 
-  bool ray_intersect(const Vec3f &p, const Vec3f &d, float &t) const {
+  float curvature(const Vec3f &p) const { return 1/r; } // zakrivljen samo u jednom smjeru, uzima se vise
+
+  void write(ByteWriter &out) const { out.put((int)CYLINDER); out.put(c); out.put(r); out.put(h); material.write(out); }
+
+
+  bool ray_intersect(const Ray &ray, float &t, SurfaceHit *hit = nullptr) const {
+    const Vec3f &p = ray.orig, &d = ray.dir;
     if((c - p)*d < 0) return false;
     else {
       float A = (d[0]*d[0])+(d[2]*d[2]);
@@ -280,83 +766,641 @@ struct Cylinder : Object {
   }
 };
 
-bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Objects &objs, Vec3f &hit, Material &material, Vec3f &N) {
+// objekt iz zapisa Object::write, nullptr ako je zapis neispravan
+unique_ptr<Object> read_object(ByteReader &in) {
+  int type;
+  in.get(type);
+  unique_ptr<Object> obj;
+  Vec3f a, b;
+  float r, h;
+  if(type == Object::SPHERE){
+    in.get(a); in.get(r);
+    obj.reset(new Sphere(a, r, Material()));
+  } else if(type == Object::CUBOID){
+    in.get(a); in.get(b);
+    obj.reset(new Cuboid(a, b, Material()));
+  } else if(type == Object::CYLINDER){
+    in.get(a); in.get(r); in.get(h);
+    obj.reset(new Cylinder(a, r, h, Material()));
+  } else if(type == Object::MODEL){
+    string name;
+    int smooth, quality, compact;
+    uint64_t memory_limit;
+    MeshSettings settings;
+    in.get(name); in.get(r); in.get(a);
+    in.get(smooth); in.get(quality); in.get(compact); in.get(memory_limit);
+    if(!in.ok || quality < BVH::FAST || quality > BVH::HIGH) return nullptr;
+    settings.smooth = smooth;
+    settings.quality = (BVH::Quality)quality;
+    settings.compact = compact;
+    settings.memory_limit = memory_limit;
+    obj.reset(new Model(name, r, a, Material(), settings));
+  } else return nullptr;
+  obj->material.read(in);
+  if(!in.ok) return nullptr;
+  return obj;
+}
+
+bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Objects &objs, Vec3f &hit, Material &material, Vec3f &N, const Object **hit_object = nullptr) {
   float dist = numeric_limits<float>::max();
   float obj_dist = dist;
+  Ray ray(orig, dir);
 
+  const Object *closest = nullptr;
+  SurfaceHit surface, obj_surface;
   for(auto obj:objs){
-    if(obj->ray_intersect(orig, dir, obj_dist) && obj_dist < dist){
+    if(obj->ray_intersect(ray, obj_dist, &obj_surface) && obj_dist < dist){
       dist = obj_dist;
-      hit = orig + dir*obj_dist;
-      N = obj->normal(hit);
-      material = obj->material;
+      closest = obj;
+      surface = obj_surface;
     }
   }
+  if(!closest) return false;
 
+  // normala se racuna samo jednom, za najblizi pogodak
+  hit = orig + dir*dist;
+  closest->shade(hit, surface);
+  N = surface.normal;
+  material = closest->material;
+  if(hit_object) *hit_object = closest;
   return dist < 1000;
 }
 
-Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const Objects &objs, const Lights &lights, const Environment& env, unsigned int depth = 0) {
+// any-hit upit za cijeli niz zraka sjene, vraca broj zaklonjenih
+int scene_occluded(const Ray *rays, const float *tmax, int n, const Objects &objs) {
+  int occluded = 0;
+  ray_stats.shadow += n;
+  for(int i = 0; i < n; i++){
+    for(auto obj:objs){
+      if(obj->occluded(rays[i], tmax[i])) { occluded++; break; }
+    }
+  }
+  return occluded;
+}
+
+// tocka na disku sfernog svjetla okrenutom prema p, k-ti od light.samples stratuma jednake povrsine:
+// redovi po n stupaca, zadnji ima samo preostale stratume pa je visina reda razmjerna njihovu broju
+Vec3f sample_light(const Light &light, const Vec3f &p, int k, int n, Sampler &sampler) {
+  if(light.radius <= 0) return light.position;
+  Vec3f w = (light.position - p).normalize();
+  Vec3f u = cross(abs(w.x) > 0.9 ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0), w).normalize();
+  Vec3f v = cross(w, u);
+  Vec2f xi = sampler.next2D();
+  int row = k/n, cols = min(n, light.samples - row*n);
+  Vec2f disk = concentric_disk(2*((k % n) + xi.x)/cols - 1, 2*(row*n + xi.y*cols)/light.samples - 1);
+  return light.position + (u*disk.x + v*disk.y)*light.radius;
+}
+
+Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const RayCone &cone, const Objects &objs, const Lights &lights, const Environment& env, Sampler &sampler, Arena &arena, unsigned int depth = 0, AuxSample *aux = nullptr);
+
+// osvjetljenje vec nadjenog pogotka zrake orig + t*dir, za primarne pogotke koje je pozivatelj sam trazio
+Vec3f shade_hit(const Vec3f &orig, const Vec3f &dir, const RayCone &cone, const Vec3f &hit_point, Vec3f hit_normal, const Material &hit_material, const Object *hit_object, const Objects &objs, const Lights &lights, const Environment& env, Sampler &sampler, Arena &arena, unsigned int depth = 0) {
+  float diffuse_light_intensity = 0;
+  float specular_light_intensity = 0;
+  float mirroring_intensity = 0.1;
+
+  for(auto light:lights){
+    Vec3f light_dir = (light.position - hit_point).normalize();
+
+    if (light_dir * hit_normal < 0) hit_normal = -hit_normal;
+    
+    Vec3f shadow_orig = hit_point + hit_normal * 0.001;
+
+    int n = ceil(sqrt((float)light.samples));
+    Arena::Scope scope(arena);
+    Ray *shadow_rays = arena.alloc<Ray>(light.samples);
+    float *shadow_dist = arena.alloc<float>(light.samples);
+    for(int k = 0; k < light.samples; k++){
+      Vec3f target = sample_light(light, hit_point, k, n, sampler);
+      new (&shadow_rays[k]) Ray(shadow_orig, (target - hit_point).normalize());
+      shadow_dist[k] = (target - hit_point).norm();
+    }
+    float visibility = 1 - (float)scene_occluded(shadow_rays, shadow_dist, light.samples, objs)/light.samples;
+    if(visibility == 0) continue;
+
+    diffuse_light_intensity += visibility * light.intensity * std::max(0.f,light_dir * hit_normal);
+
+    Vec3f view_dir = (orig - hit_point).normalize();
+    Vec3f half_vec = (view_dir+light_dir).normalize();    
+    specular_light_intensity += visibility * light.intensity * powf(std::max(0.f,half_vec * hit_normal), hit_material.specular_exponent);
+  }
+  Vec3f refraction_vec = dir + (-hit_normal)*hit_material.refraction_index; // Racuno sam ovak zbog jednostavnosti
+  // otisak na plohi; konveksno zrcalo siri refleksiju za 2*sirina*zakrivljenost, refrakcija zadrzava kut
+  float hit_width = cone.width_at((hit_point - orig).norm());
+  RayCone reflected(hit_width, cone.spread + 2*hit_width*hit_object->curvature(hit_point));
+  RayCone refracted(hit_width, cone.spread);
+  return hit_material.diffuse_color * hit_material.albedo[0] * diffuse_light_intensity
+         + Vec3f(1,1,1) * hit_material.albedo[1] * specular_light_intensity 
+         + cast_ray(hit_point+hit_normal*0.01, (dir - (hit_normal*(dir*hit_normal))*2.0), reflected, objs, lights, env, sampler, arena, depth+1)*mirroring_intensity
+         + cast_ray(hit_point+hit_normal*0.01, refraction_vec, refracted, objs, lights, env, sampler, arena, (hit_material.alpha == 1 ? 13 : depth+1))*(1-hit_material.alpha);
+}
+
+// cone je ray differential zrake, prenosi se kroz refleksije i refrakcije do teksture okoline;
+// arena sluzi za privremene nizove (zrake sjene), sve se vraca prije izlaska
+Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const RayCone &cone, const Objects &objs, const Lights &lights, const Environment& env, Sampler &sampler, Arena &arena, unsigned int depth, AuxSample *aux) {
   if(depth > 12) return {0, 0, 0};
+  if(depth > 0) ray_stats.secondary++;
   Vec3f hit_point, hit_normal;
   Material hit_material;
-  if(!scene_intersect(orig, dir, objs, hit_point, hit_material, hit_normal)) return env.map(orig, dir);
-  else {
-    float diffuse_light_intensity = 0;
-    float specular_light_intensity = 0;
-    float mirroring_intensity = 0.1;
+  const Object *hit_object = nullptr;
+  if(!scene_intersect(orig, dir, objs, hit_point, hit_material, hit_normal, &hit_object)) {
+    Vec3f background = env.map(orig, dir, cone.spread);
+    if(aux) { aux->albedo = background; aux->normal = -dir; }
+    return background;
+  }
+  if(aux) {
+    aux->albedo = hit_material.diffuse_color;
+    aux->normal = hit_normal;
+    aux->depth = (hit_point - orig).norm();
+  }
+  return shade_hit(orig, dir, cone, hit_point, hit_normal, hit_material, hit_object, objs, lights, env, sampler, arena, depth);
+}
+
+struct Tile {
+  int x0, y0, x1, y1;
+};
+
+// Cache prethodnog framea za animacije kamere kroz staticnu scenu. Za svaki piksel se trazi samo
+// primarni pogodak; ako se ta tocka u prethodnom frameu vidjela u pikselu s istom pozicijom i
+// normalom, a smjer gledanja se malo promijenio (spekularni dio i refleksije ovise o njemu),
+// boja se preuzima. Ostali pikseli (disokluzije, promasaji, rubovi) se racunaju ispocetka.
+// Radi samo za PERSPECTIVE i spp = 1; promjenu scene ili svjetala treba javiti s invalidate().
+struct ReprojectionCache {
+  float position_tolerance; // u pikselima, prema velicini piksela na udaljenosti pogotka
+  float min_view_cos;       // minimalni kosinus kuta izmedju starog i novog smjera gledanja
+  atomic<long long> reused{0}, retraced{0}; // za zadnji frame
+
+  ReprojectionCache(const float& position_tolerance = 0.5, const float& min_view_cos = 0.9995) : position_tolerance(position_tolerance), min_view_cos(min_view_cos) {}
+
+  void invalidate() { prev_valid = false; }
+
+  bool usable(const Viewport& view, const Camera& cam) const {
+    return view.spp == 1 && cam.projection == Camera::PERSPECTIVE;
+  }
+
+  void begin_frame(const Viewport& view) {
+    if(prev_valid && (prev_nx != (int)view.nx || prev_ny != (int)view.ny)) prev_valid = false;
+    size_t n = (size_t)view.nx*view.ny;
+    position.assign(n, Vec3f()); origin.assign(n, Vec3f()); normal.assign(n, Vec3f()); color.assign(n, Vec3f()); hit.assign(n, 0);
+    reused = retraced = 0;
+  }
 
-    for(auto light:lights){
-      Vec3f light_dir = (light.position - hit_point).normalize();
-      float light_dist = (light.position - hit_point).norm();
+  void end_frame(const Viewport& view, const Camera& cam) {
+    swap(position, prev_position); swap(origin, prev_origin); swap(normal, prev_normal); swap(color, prev_color); swap(hit, prev_hit);
+    prev_raygen = RayGenerator(cam, view);
+    prev_nx = view.nx; prev_ny = view.ny;
+    prev_valid = true;
+  }
+
+  // boja iz prethodnog framea za primarni pogodak p s normalom n, gledano iz cam_pos;
+  // shading_point je tocka za koju je ta boja stvarno izracunata, a shading_origin kamera iz
+  // koje je izracunata. Kut se usporeduje s tom kamerom, ne s prethodnom, pa se boja ne moze
+  // prenositi iz framea u frame dok se smjer gledanja polako udaljava
+  bool lookup(const Vec3f& p, const Vec3f& n, const Vec3f& cam_pos, Vec3f& out, Vec3f& shading_point, Vec3f& shading_origin) const {
+    float px, py;
+    if(!prev_valid || !prev_raygen.project(p, px, py)) return false;
+    int j = lrintf(px), i = lrintf(py); // zraka piksela j prolazi tocno kroz px = j
+    if(j < 0 || i < 0 || j >= prev_nx || i >= prev_ny) return false;
+    size_t idx = (size_t)i*prev_nx + j;
+    if(!prev_hit[idx]) return false;
+    float dist = (p - cam_pos).norm();
+    Vec3f view_dir = (p - cam_pos)*(1/dist);
+    float footprint = dist/(prev_raygen.cam_dist*max(0.05f, abs(view_dir*n))); // piksel projiciran na plohu
+    if((prev_position[idx] - p).norm() > position_tolerance*footprint) return false;
+    if(prev_normal[idx]*n < 0.99f) return false;
+    if(view_dir*(prev_position[idx] - prev_origin[idx]).normalize() < min_view_cos) return false;
+    out = prev_color[idx];
+    shading_point = prev_position[idx];
+    shading_origin = prev_origin[idx];
+    return true;
+  }
 
-      Vec3f shadow_orig, shadow_hit_point, shadow_hit_normal;
-      Material shadow_material;
+  // tileovi se renderiraju paralelno, ali svaki piksel pise samo jedna dretva
+  void store(size_t idx, const Vec3f& p, const Vec3f& o, const Vec3f& n, const Vec3f& c) {
+    position[idx] = p; origin[idx] = o; normal[idx] = n; color[idx] = c; hit[idx] = 1;
+  }
 
-      if (light_dir * hit_normal < 0) hit_normal = -hit_normal;
-      
-      shadow_orig = hit_point + hit_normal * 0.001;
+private:
+  vector<Vec3f> position, origin, normal, color, prev_position, prev_origin, prev_normal, prev_color;
+  vector<char> hit, prev_hit;
+  RayGenerator prev_raygen = RayGenerator(Camera(Vec3f(0, 0, 0), Vec3f(0, 0, -1), 0), Viewport(1, 1, 1));
+  int prev_nx = 0, prev_ny = 0;
+  bool prev_valid = false;
+};
 
-      if(scene_intersect(shadow_orig, light_dir, objs, shadow_hit_point, shadow_material, shadow_hit_normal) && (shadow_orig - shadow_hit_point).norm() < light_dist) continue;
+vector<Tile> make_tiles(int nx, int ny, int size) {
+  vector<Tile> tiles;
+  for(int y = 0; y < ny; y += size)
+    for(int x = 0; x < nx; x += size)
+      tiles.push_back({x, y, min(x + size, nx), min(y + size, ny)});
+  return tiles;
+}
 
-      diffuse_light_intensity += light.intensity * std::max(0.f,light_dir * hit_normal);
+// renderira tile u buffer (i aux ako je zadan) velicine cijele slike
+// cache (ako je zadan) se koristi samo kad je cache->usable(view, cam);
+// arena se resetira na pocetku i sav privremeni prostor tilea ide iz nje
+void render_tile(const Viewport& view, const Camera &cam, const RayGenerator& raygen, const Objects &objs, const Lights &lghts, const Environment& env, const Tile& tile, vector<Vec3f>& buffer, AuxBuffers *aux, Arena &arena, ReprojectionCache *cache = nullptr){
+  const int nx = view.nx, w = tile.x1 - tile.x0;
 
-      Vec3f view_dir = (orig - hit_point).normalize();
-      Vec3f half_vec = (view_dir+light_dir).normalize();    
-      specular_light_intensity += light.intensity * powf(std::max(0.f,half_vec * hit_normal), hit_material.specular_exponent);
+  arena.reset();
+  Sampler *samplers = arena.alloc<Sampler>(w);
+  Vec2f *jitter = arena.alloc<Vec2f>(w), *lens = arena.alloc<Vec2f>(w);
+  AuxSample *first_hit = arena.alloc<AuxSample>(w);
+  CameraRays rays(arena, w);
+  long long reused = 0, retraced = 0;
+  for(int i = tile.y0; i < tile.y1; i++){
+    Vec3f *row = &buffer[i*nx + tile.x0];
+    for(int j = 0; j < w; j++) row[j] = Vec3f();
+    for(int k = 0; k < view.spp; k++){
+      for(int j = 0; j < w; j++){
+        new (&samplers[j]) Sampler(tile.x0 + j, i, k, view.seed);
+        jitter[j] = view.spp > 1 ? samplers[j].next2D() : Vec2f(0.5, 0.5); // jitter unutar piksela
+        if(cam.projection == Camera::THIN_LENS) lens[j] = samplers[j].next2D();
+      }
+      raygen.generate_row(i, tile.x0, w, jitter, lens, rays);
+      for(int j = 0; j < w; j++){
+        ray_stats.primary++;
+        AuxSample sample_hit;
+        if(cache){
+          Vec3f hit_point, hit_normal, color;
+          Material hit_material;
+          const Object *hit_object = nullptr;
+          size_t idx = (size_t)i*nx + tile.x0 + j;
+          if(scene_intersect(rays.orig(j), rays.dir(j), objs, hit_point, hit_material, hit_normal, &hit_object)){
+            Vec3f shading_point = hit_point; // pamte se izvorna tocka i kamera da se greska ne nakuplja kroz frameove
+            Vec3f shading_origin = rays.orig(j);
+            if(cache->lookup(hit_point, hit_normal, rays.orig(j), color, shading_point, shading_origin)) reused++;
+            else { color = shade_hit(rays.orig(j), rays.dir(j), raygen.pixel_cone(), hit_point, hit_normal, hit_material, hit_object, objs, lghts, env, samplers[j], arena); retraced++; }
+            cache->store(idx, shading_point, shading_origin, hit_normal, color);
+            sample_hit.albedo = hit_material.diffuse_color;
+            sample_hit.normal = hit_normal;
+            sample_hit.depth = (hit_point - rays.orig(j)).norm();
+          } else {
+            color = env.map(rays.orig(j), rays.dir(j), raygen.pixel_cone().spread);
+            sample_hit.albedo = color;
+            sample_hit.normal = -rays.dir(j);
+          }
+          row[j] = color;
+        }
+        else row[j] = row[j] + cast_ray(rays.orig(j), rays.dir(j), raygen.pixel_cone(), objs, lghts, env, samplers[j], arena, 0, aux ? &sample_hit : nullptr);
+        if(!aux) continue;
+        if(k == 0) first_hit[j] = AuxSample();
+        first_hit[j].albedo = first_hit[j].albedo + sample_hit.albedo*(1.f/view.spp);
+        first_hit[j].normal = first_hit[j].normal + sample_hit.normal*(1.f/view.spp);
+        first_hit[j].depth = k == 0 ? sample_hit.depth : min(first_hit[j].depth, sample_hit.depth);
+      }
     }
-    Vec3f refraction_vec = dir + (-hit_normal)*hit_material.refraction_index; // Racuno sam ovak zbog jednostavnosti
-    return hit_material.diffuse_color * hit_material.albedo[0] * diffuse_light_intensity
-           + Vec3f(1,1,1) * hit_material.albedo[1] * specular_light_intensity 
-           + cast_ray(hit_point+hit_normal*0.01, (dir - (hit_normal*(dir*hit_normal))*2.0), objs, lights, env, depth+1)*mirroring_intensity
-           + cast_ray(hit_point+hit_normal*0.01, refraction_vec, objs, lights, env, (hit_material.alpha == 1 ? 13 : depth+1))*(1-hit_material.alpha);
+    for(int j = 0; j < w; j++){
+      row[j] = row[j]*(1.f/view.spp);
+      if(aux){
+        aux->albedo[i*nx + tile.x0 + j] = first_hit[j].albedo;
+        aux->normal[i*nx + tile.x0 + j] = first_hit[j].normal.normalize();
+        aux->depth[i*nx + tile.x0 + j] = first_hit[j].depth;
+      }
+    }
+  }
+  if(cache){
+    cache->reused += reused;
+    cache->retraced += retraced;
   }
 }
 
-void render(const Viewport& view, const Objects &objs, const Camera &cam, const Lights &lghts, const Environment& env, const string& filename){
-  vector<Vec3f> buffer(view.nx*view.ny);
-  float cam_dist = (view.nx*0.5)/(tan(view.fov/2.));
-
-  for(int i = 0; i < view.ny; i++){
-    for(int j = 0; j < view.nx; j++){
-      Vec3f dir = cam.dir*cam_dist + cam.dir_up * (j - view.nx*0.5) + cam.dir_right * (i - view.ny*0.5);
-      dir.normalize();
-      dir = dir*cos(cam.roll) + cross(cam.dir, dir)*sin(cam.roll) + cam.dir*(cam.dir*dir)*(1-cos(cam.roll)); //Rodrigues rotation
-      dir.normalize();
-      buffer[i*view.nx + j] = (cast_ray(cam.pos, dir, objs, lghts, env));
+#ifndef _WIN32
+bool write_all(int fd, const void *data, size_t size) {
+  const char *p = (const char*)data;
+  while(size > 0){
+    ssize_t n = write(fd, p, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    p += n; size -= n;
+  }
+  return true;
+}
+
+bool read_all(int fd, void *data, size_t size) {
+  char *p = (char*)data;
+  while(size > 0){
+    ssize_t n = read(fd, p, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    p += n; size -= n;
+  }
+  return true;
+}
+#endif
+
+// Koordinator za renderiranje jednog ili vise frameova u vise procesa. Workeri su fork-ani procesi
+// koji od roditelja ne koriste nista: za svaki frame kroz pipe dobivaju zapis scene (objekti s
+// materijalima, modeli i okolina po imenu datoteke) te viewport, kameru i svjetla, a zatim tileove
+// jedan po jedan. Scenu ponovno ucitavaju samo kad se zapis promijeni. Ako worker umre, pipe pukne
+// ili tile ne vrati unutar tile_timeout_ms, worker se ubija, a tile se vraca u red i dodjeljuje
+// drugome; bez zivih workera ostatak se renderira lokalno.
+// Na Windowsu nema fork-a pa nema ni workera i render() radi lokalno.
+struct RenderFarm {
+  enum MsgType { FRAME, TILE, QUIT };
+  struct Msg {
+    int type;
+    Tile tile;
+  };
+  struct TileResult {
+    Tile tile;
+    RayStats stats;
+    long long allocations; // heap alokacije workera u render_tile
+  };
+  struct Worker {
+    int pid, job_fd, result_fd;
+    int tile; // indeks tilea koji renderira, -1 ako ceka
+    chrono::steady_clock::time_point deadline;
+  };
+  vector<Worker> workers;
+  int tile_size, tile_timeout_ms;
+
+  // za testiranje: ako je fail_after >= 0, prvi worker nakon toliko gotovih tileova umire usred
+  // tilea, ili zauvijek zastane ako je hang
+  RenderFarm(const int& n, const int& tile_size = 32, const int& tile_timeout_ms = 30000, const int& fail_after = -1, const bool& hang = false) : tile_size(tile_size), tile_timeout_ms(tile_timeout_ms) {
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+    cout.flush();
+    for(int w = 0; w < n; w++){
+      int job[2], result[2];
+      if(pipe(job) != 0) break;
+      if(pipe(result) != 0) { close(job[0]); close(job[1]); break; }
+      int pid = fork();
+      if(pid == 0){
+        close(job[1]); close(result[0]);
+        for(auto &other:workers) { close(other.job_fd); close(other.result_fd); }
+        worker_loop(job[0], result[1], w == 0 ? fail_after : -1, hang);
+      }
+      close(job[0]); close(result[1]);
+      if(pid < 0) { close(job[1]); close(result[0]); break; }
+      workers.push_back({pid, job[1], result[0], -1, {}});
+    }
+#endif
+  }
+
+  ~RenderFarm() {
+#ifndef _WIN32
+    for(auto &w:workers){
+      Msg msg = {QUIT, {}};
+      write_all(w.job_fd, &msg, sizeof(msg));
+      close(w.job_fd); close(w.result_fd);
+      waitpid(w.pid, nullptr, 0);
+    }
+#endif
+  }
+
+  // vraca false ako nema workera, tada render() radi lokalno; allocations dobiva zbroj heap
+  // alokacija u render_tile iz svih workera
+  bool render(const Viewport& view, const Objects &objs, const Camera &cam, const Lights &lghts, const Environment& env, vector<Vec3f>& buffer, AuxBuffers *aux, long long &allocations) {
+#ifdef _WIN32
+    return false;
+#else
+    if(workers.empty()) return false;
+    int with_aux = aux != nullptr;
+    ByteWriter scene, frame;
+    scene.put((int)objs.size());
+    for(auto obj:objs) obj->write(scene);
+    env.write(scene);
+    view.write(frame);
+    cam.write(frame);
+    frame.put((int)lghts.size());
+    for(auto &l:lghts) l.write(frame);
+    frame.put(with_aux);
+    for(size_t w = 0; w < workers.size(); w++){
+      Msg msg = {FRAME, {}};
+      Worker &wk = workers[w];
+      if(!(write_all(wk.job_fd, &msg, sizeof(msg)) && write_bytes(wk.job_fd, scene.bytes) && write_bytes(wk.job_fd, frame.bytes)))
+        drop(w--);
+    }
+
+    vector<Tile> tiles = make_tiles(view.nx, view.ny, tile_size);
+    deque<int> pending;
+    for(size_t t = 0; t < tiles.size(); t++) pending.push_back(t);
+    size_t done = 0;
+    vector<float> payload;
+    vector<pollfd> fds;
+    while(done < tiles.size()){
+      for(size_t w = 0; w < workers.size() && !pending.empty(); w++){
+        if(workers[w].tile != -1) continue;
+        Msg msg = {TILE, tiles[pending.front()]};
+        if(!write_all(workers[w].job_fd, &msg, sizeof(msg))) { drop(w--, &pending); continue; }
+        workers[w].tile = pending.front();
+        // prvi tile framea ukljucuje i ucitavanje scene u workeru
+        workers[w].deadline = chrono::steady_clock::now() + chrono::milliseconds(tile_timeout_ms);
+        pending.pop_front();
+      }
+      if(workers.empty()){
+        cerr << "render farm: nema zivih workera, ostatak se renderira lokalno" << endl;
+        RayGenerator raygen(cam, view);
+        Arena arena;
+        for(int t:pending){
+          long long before = heap_allocations;
+          render_tile(view, cam, raygen, objs, lghts, env, tiles[t], buffer, aux, arena);
+          allocations += heap_allocations - before;
+        }
+        return true;
+      }
+
+      // poll ceka najvise do prvog isteklog tilea
+      auto now = chrono::steady_clock::now();
+      auto wait = chrono::milliseconds(tile_timeout_ms);
+      for(auto &w:workers) if(w.tile != -1) wait = min(wait, chrono::duration_cast<chrono::milliseconds>(w.deadline - now) + chrono::milliseconds(1));
+      fds.clear();
+      for(auto &w:workers) fds.push_back({w.result_fd, POLLIN, 0});
+      if(poll(fds.data(), fds.size(), max(0, (int)wait.count())) < 0) continue;
+      for(size_t w = fds.size(); w--; ){
+        if(!(fds[w].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        TileResult res;
+        if(!read_all(workers[w].result_fd, &res, sizeof(res))) { drop(w, &pending); continue; }
+        const Tile &t = res.tile;
+        const int tw = t.x1 - t.x0, th = t.y1 - t.y0;
+        payload.resize((size_t)tw*th*(with_aux ? 10 : 3));
+        if(!read_all(workers[w].result_fd, payload.data(), payload.size()*sizeof(float))) { drop(w, &pending); continue; }
+        const float *p = payload.data();
+        for(int y = t.y0; y < t.y1; y++, p += 3*tw) memcpy(&buffer[y*(int)view.nx + t.x0].x, p, 3*tw*sizeof(float));
+        if(with_aux){
+          for(int y = t.y0; y < t.y1; y++, p += 3*tw) memcpy(&aux->albedo[y*(int)view.nx + t.x0].x, p, 3*tw*sizeof(float));
+          for(int y = t.y0; y < t.y1; y++, p += 3*tw) memcpy(&aux->normal[y*(int)view.nx + t.x0].x, p, 3*tw*sizeof(float));
+          for(int y = t.y0; y < t.y1; y++, p += tw) memcpy(&aux->depth[y*(int)view.nx + t.x0], p, tw*sizeof(float));
+        }
+        ray_stats.add(res.stats);
+        allocations += res.allocations;
+        workers[w].tile = -1;
+        done++;
+      }
+      now = chrono::steady_clock::now();
+      for(size_t w = workers.size(); w--; )
+        if(workers[w].tile != -1 && now >= workers[w].deadline) drop(w, &pending, "ne odgovara");
     }
+    return true;
+#endif
+  }
+
+private:
+#ifndef _WIN32
+  // ubija workera i vraca njegov tile na pocetak reda
+  void drop(size_t w, deque<int> *pending = nullptr, const char *reason = "je pao") {
+    Worker wk = workers[w];
+    cerr << "render farm: worker " << wk.pid << " " << reason << (wk.tile != -1 ? ", tile ide drugome" : "") << endl;
+    if(pending && wk.tile != -1) pending->push_front(wk.tile);
+    close(wk.job_fd); close(wk.result_fd);
+    kill(wk.pid, SIGKILL);
+    waitpid(wk.pid, nullptr, 0);
+    workers.erase(workers.begin() + w);
+  }
+
+  static bool write_bytes(int fd, const vector<char> &bytes) {
+    int size = bytes.size();
+    return write_all(fd, &size, sizeof(size)) && write_all(fd, bytes.data(), size);
+  }
+
+  static bool read_bytes(int fd, vector<char> &bytes) {
+    int size;
+    if(!read_all(fd, &size, sizeof(size)) || size < 0) return false;
+    bytes.resize(size);
+    return read_all(fd, bytes.data(), size);
   }
 
+  // scena u workeru; objekti i okolina se grade iz zapisa i drze dok se zapis ne promijeni
+  struct WorkerScene {
+    vector<char> bytes;
+    vector<unique_ptr<Object>> owned;
+    Objects objs;
+    unique_ptr<Environment> env;
+
+    bool load(const vector<char> &scene) {
+      if(env && scene == bytes) return true;
+      owned.clear();
+      objs.clear();
+      env.reset();
+      bytes = scene;
+      ByteReader in(bytes);
+      int n;
+      in.get(n);
+      for(int i = 0; i < n && in.ok; i++){
+        owned.push_back(read_object(in));
+        if(!owned.back()) return false;
+        objs.push_back(owned.back().get());
+      }
+      string filename;
+      int r, width, height;
+      in.get(filename); in.get(r); in.get(width); in.get(height);
+      if(!in.ok || width <= 0 || height <= 0) return false;
+      env.reset(new Environment(filename, r, width, height));
+      return true;
+    }
+  };
+
+  [[noreturn]] static void worker_loop(int job_fd, int result_fd, int fail_after, bool hang) {
+    // ispis ucitavanja modela je vec bio u koordinatoru, greske idu na cerr
+    cout.setstate(ios::failbit);
+    WorkerScene scene;
+    Viewport view(0, 0, 0);
+    Camera cam(Vec3f(0, 0, 0), Vec3f(0, 0, -1), 0);
+    Lights lghts;
+    int with_aux = 0, tiles_done = 0;
+    vector<Vec3f> buffer;
+    AuxBuffers aux;
+    vector<float> payload;
+    vector<char> scene_bytes, frame_bytes;
+    Arena arena;
+    Msg msg;
+    while(read_all(job_fd, &msg, sizeof(msg)) && msg.type != QUIT){
+      if(msg.type == FRAME){
+        if(!(read_bytes(job_fd, scene_bytes) && read_bytes(job_fd, frame_bytes))) break;
+        if(!scene.load(scene_bytes)) { cerr << "render farm: neispravan zapis scene" << endl; break; }
+        ByteReader in(frame_bytes);
+        int nlights;
+        view.read(in);
+        cam.read(in);
+        in.get(nlights);
+        if(nlights < 0 || nlights > 1 << 16) break;
+        lghts.assign(nlights, Light(Vec3f(), 0));
+        for(auto &l:lghts) l.read(in);
+        in.get(with_aux);
+        if(!in.ok) { cerr << "render farm: neispravan zapis framea" << endl; break; }
+        buffer.assign(view.nx*view.ny, Vec3f());
+        if(with_aux) aux.resize(buffer.size());
+        continue;
+      }
+      const Tile &t = msg.tile;
+      if(fail_after >= 0 && tiles_done >= fail_after){
+        if(!hang) _exit(1);
+        for(;;) pause();
+      }
+      ray_stats = RayStats();
+      long long before = heap_allocations;
+      render_tile(view, cam, RayGenerator(cam, view), scene.objs, lghts, *scene.env, t, buffer, with_aux ? &aux : nullptr, arena);
+      TileResult res = {t, ray_stats, heap_allocations - before};
+      const int tw = t.x1 - t.x0, nx = view.nx;
+      payload.clear();
+      auto append = [&](const float *src, int count) { payload.insert(payload.end(), src, src + count); };
+      for(int y = t.y0; y < t.y1; y++) append(&buffer[y*nx + t.x0].x, 3*tw);
+      if(with_aux){
+        for(int y = t.y0; y < t.y1; y++) append(&aux.albedo[y*nx + t.x0].x, 3*tw);
+        for(int y = t.y0; y < t.y1; y++) append(&aux.normal[y*nx + t.x0].x, 3*tw);
+        for(int y = t.y0; y < t.y1; y++) append(&aux.depth[y*nx + t.x0], tw);
+      }
+      if(!(write_all(result_fd, &res, sizeof(res)) && write_all(result_fd, payload.data(), payload.size()*sizeof(float)))) break;
+      tiles_done++;
+    }
+    _exit(0);
+  }
+#endif
+};
+
+struct RenderSettings {
+  AuxBuffers *aux = nullptr;          // ako je zadan, dobiva albedo/normalu/dubinu prvog pogotka
+  const Denoiser *denoiser = nullptr; // primjenjuje se na float buffer prije zapisa
+  ToneMapper tonemap;                 // za 8-bitni PPM
+  string hdr_filename;                // ako nije prazan, zapisuje se i float slika (PFM)
+  RenderFarm *farm = nullptr;         // ako je zadan, tileovi se renderiraju u worker procesima
+  ReprojectionCache *cache = nullptr; // za animacije kamere, renderira se lokalno
+};
+
+void render(const Viewport& view, const Objects &objs, const Camera &cam, const Lights &lghts, const Environment& env, const string& filename, const RenderSettings& settings = RenderSettings()){
+  ray_stats = RayStats();
+  vector<Vec3f> buffer(view.nx*view.ny);
+  AuxBuffers local_aux;
+  AuxBuffers *aux = settings.aux;
+  if(!aux && settings.denoiser) aux = &local_aux;
+  if(aux) aux->resize(buffer.size());
+  ReprojectionCache *cache = settings.cache && settings.cache->usable(view, cam) ? settings.cache : nullptr;
+  if(cache) cache->begin_frame(view);
+  long long tile_allocations = 0;
+  if(cache || !settings.farm || !settings.farm->render(view, objs, cam, lghts, env, buffer, aux, tile_allocations)){
+    // tileovi paralelno, svaka dretva ima svoju arenu; rezultat ne ovisi o rasporedu jer je sampler po pikselu
+    RayGenerator raygen(cam, view);
+    vector<Tile> tiles = make_tiles(view.nx, view.ny, 32);
+    vector<Arena> arenas(thread_count());
+    mutex stats_mutex;
+    RayStats total;
+    parallel_for_indexed(tiles.size(), [&](int t, int thread){
+      ray_stats = RayStats();
+      long long before = heap_allocations;
+      render_tile(view, cam, raygen, objs, lghts, env, tiles[t], buffer, aux, arenas[thread], cache);
+      long long allocations = heap_allocations - before;
+      lock_guard<mutex> lock(stats_mutex);
+      total.add(ray_stats);
+      tile_allocations += allocations;
+    }, arenas.size());
+    ray_stats = total;
+  }
+  if(cache) cache->end_frame(view, cam);
+
+  if(settings.denoiser) settings.denoiser->apply(buffer, *aux, view.nx, view.ny);
+  if(!settings.hdr_filename.empty()) write_pfm(settings.hdr_filename, buffer, view.nx, view.ny);
+
+  vector<unsigned char> ldr;
+  settings.tonemap.apply(buffer, ldr);
   ofstream ofs;
   ofs.open(filename, ofstream::binary);
   ofs << "P6\n" << view.nx << " " << view.ny << "\n255\n";
-  for(int i = 0; i < view.ny * view.nx; i++) {
-      for(int j = 0; j < 3; j++) {
-          unsigned char color = (unsigned char)(255.f * max(0.f, min(1.f, buffer[i][j])));
-          ofs << color;
-      }            
-  }
+  ofs.write((const char*)ldr.data(), ldr.size());
   ofs.close();
+  cout << filename << ": " << ray_stats.primary << " primary, " << ray_stats.secondary << " secondary, " << ray_stats.shadow << " shadow rays, " << tile_allocations << " heap allocations in tiles";
+  if(cache) cout << ", reprojection reused " << cache->reused << "/" << cache->reused + cache->retraced << " hits (" << 100.0*cache->reused/max(1LL, cache->reused + cache->retraced) << "%)";
+  cout << endl;
 }
 
 int main() {
@@ -373,13 +1417,16 @@ int main() {
   Sphere o4(Vec3f(7, 5, -18), 4, gray);
   Sphere o5(Vec3f(2, 1.5, -9), 1, red);
 
-  Model tetrahedron("./tetrahedron.obj", 2, Vec3f(2, 5, -15), red);
-  Model octahedron("./octahedron.obj", 5, Vec3f(-10, 3, -15), green);
+  MeshSettings streamed, compact;
+  streamed.memory_limit = 1 << 20;
+  compact.compact = true;
+  Model tetrahedron("./tetrahedron.obj", 2, Vec3f(2, 5, -15), red, streamed);
+  Model octahedron("./octahedron.obj", 5, Vec3f(-10, 3, -15), green, compact);
   
   Objects objs = { &surface, &o1, &o2, &o3, &o4, &o5,  &tetrahedron, &octahedron};
 
-  Light l1 = Light(Vec3f(-20, 50, 20), 1.5);
-  Light l2 = Light(Vec3f(20, 30, 20), 1.8);
+  Light l1 = Light(Vec3f(-20, 50, 20), 1.5, 3, 16);
+  Light l2 = Light(Vec3f(20, 30, 20), 1.8, 3, 16);
   Lights lights = { l1, l2 };
   
   Viewport view(1024, 768, M_PI/2);
@@ -393,11 +1440,42 @@ int main() {
 
   Environment env("./environment.ppm", 1500, 2880, 1800);
 
-  render(view, objs, cam, lights, env, "./view1.ppm");
+  RenderSettings hdr;
+  hdr.hdr_filename = "./view1.pfm";
+  render(view, objs, cam, lights, env, "./view1.ppm", hdr);
   render(view, objs, cam2, lights, env, "./view2.ppm");
   render(view2, objs, cam, lights, env, "./view3.ppm");
-  render(view3, objs, cam2, lights, env, "./view4.ppm");
+  RenderFarm farm(4);
+  RenderSettings distributed;
+  distributed.farm = &farm;
+  render(view3, objs, cam2, lights, env, "./view4.ppm", distributed);
   render(view, objs, cam3, lights, env, "./view5.ppm");
+
+  Denoiser denoiser;
+  RenderSettings denoised;
+  denoised.denoiser = &denoiser;
+  denoised.tonemap = ToneMapper(ToneMapper::ACES, 0.5);
+  Light l1_noisy = Light(Vec3f(-20, 50, 20), 1.5, 3, 2);
+  Light l2_noisy = Light(Vec3f(20, 30, 20), 1.8, 3, 2);
+  Lights noisy_lights = { l1_noisy, l2_noisy };
+  render(view, objs, cam2, noisy_lights, env, "./view6.ppm", denoised);
+
+  Viewport view_dof(512, 384, M_PI/2, 4);
+  Camera cam_dof(Vec3f(0,0,0), Vec3f(0,0,-1), 0);
+  cam_dof.projection = Camera::THIN_LENS;
+  cam_dof.aperture = 0.4;
+  cam_dof.focus_dist = 18;
+  render(view_dof, objs, cam_dof, lights, env, "./view7.ppm");
+
+  ReprojectionCache cache;
+  RenderSettings animated;
+  animated.cache = &cache;
+  Viewport view_anim(512, 384, M_PI/2);
+  for(int frame = 0; frame < 4; frame++){
+    Camera cam_anim(Vec3f(0.05*frame, 0, 0), Vec3f(-0.002*frame, 0, -1), 0);
+    render(view_anim, objs, cam_anim, lights, env, "./anim" + to_string(frame) + ".ppm", animated);
+  }
   
+  tetrahedron.print_residency();
   return 0;
 }
\ No newline at end of file
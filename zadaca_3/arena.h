@@ -0,0 +1,82 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+// Bump alokator za privremene podatke renderiranja. Svaka dretva ima svoj, reset() se
+// zove na pocetku svakog tilea i ne oslobadja memoriju, pa nakon prvih tileova nema vise
+// alokacija na heapu. Scope vraca poziciju na kraju bloka (npr. zrake sjene jednog pogotka).
+// Destruktori se ne zovu, dozvoljeni su samo trivijalno unistivi tipovi. Blokovi se alociraju
+// kroz globalni operator new, pa ih brojac alokacija u render() vidi kao i svaku drugu.
+class Arena {
+public:
+    // prvi blok se alocira odmah, da ni prvi tile ne ide na heap
+    explicit Arena(size_t block_size = 1 << 20) : block_size(block_size) { add_block(block_size); }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other) noexcept : blocks(std::move(other.blocks)), block_size(other.block_size), current(other.current), offset(other.offset) {
+        other.current = 0; other.offset = 0;
+    }
+    ~Arena() {
+        for (auto &b : blocks) ::operator delete(b.data);
+    }
+
+    template <typename T> T* alloc(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena ne zove destruktore");
+        return static_cast<T*>(alloc_bytes(n*sizeof(T), alignof(T)));
+    }
+
+    // kao alloc, ali svaki element se konstruira kopijom value
+    template <typename T> T* alloc(size_t n, const T& value) {
+        T *p = alloc<T>(n);
+        for (size_t i = 0; i < n; i++) new (&p[i]) T(value);
+        return p;
+    }
+
+    void reset() { current = 0; offset = 0; }
+
+    size_t capacity() const {
+        size_t c = 0;
+        for (auto &b : blocks) c += b.size;
+        return c;
+    }
+
+    struct Scope {
+        Arena &arena;
+        size_t current, offset;
+        explicit Scope(Arena &arena) : arena(arena), current(arena.current), offset(arena.offset) {}
+        ~Scope() { arena.current = current; arena.offset = offset; }
+    };
+
+private:
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0; // indeks bloka iz kojeg se alocira
+    size_t offset = 0;  // zauzeto u tom bloku
+
+    void* alloc_bytes(size_t size, size_t align) {
+        while (true) {
+            if (current < blocks.size()) {
+                size_t start = (offset + align - 1) & ~(align - 1);
+                if (start + size <= blocks[current].size) {
+                    offset = start + size;
+                    return blocks[current].data + start;
+                }
+                if (current + 1 < blocks.size()) { current++; offset = 0; continue; }
+            }
+            add_block(std::max(size + align, block_size));
+            current = blocks.size() - 1;
+            offset = 0;
+        }
+    }
+
+    void add_block(size_t size) {
+        blocks.push_back({static_cast<char*>(::operator new(size)), size});
+    }
+};
@@ -0,0 +1,641 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "ray.h"
+#include "parallel.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define QBVH_SSE
+#endif
+
+// Cvor BVH-a u dubinskom poretku: lijevo dijete je uvijek odmah iza roditelja,
+// pa unutarnji cvor pamti samo desno. 32 bajta, dva cvora u liniji cachea.
+struct BVHNode {
+    AABB box;
+    int offset; // list: prvi primitiv u BVH::prims, unutarnji cvor: indeks desnog djeteta
+    int count;  // broj primitiva u listu, 0 za unutarnji cvor
+    bool leaf() const { return count > 0; }
+};
+
+struct BVHStats {
+    double build_ms = 0;
+    float sah_cost = 0; // ocekivani trosak zrake (cvor = 1, primitiv = 1) relativno na korijen
+    int nodes = 0, leaves = 0, depth = 0;
+};
+
+// BVH nad proizvoljnim primitivima zadanim kutijama. FAST gradi LBVH (Mortonovi kodovi i
+// radix sort), BALANCED i HIGH binned SAH s 8 odnosno 32 kosare. Obje gradnje su paralelne:
+// velike cvorove binaju sve dretve, a podstabla se dijele na zadatke; rezultat ne ovisi o broju dretvi.
+struct BVH {
+    enum Quality { FAST, BALANCED, HIGH };
+
+    std::vector<BVHNode> nodes;
+    std::vector<int> prims; // originalni indeksi primitiva poredani po listovima
+    BVHStats stats;
+
+    static const int max_depth = 48;     // obilazak koristi stog fiksne velicine
+    static const int max_leaf = 4;
+    static const int task_size = 4096;   // manja podstabla se grade serijski
+    static const int parallel_bin = 1 << 15;
+    static const int max_bins = 32;
+
+    void build(const std::vector<AABB> &boxes, Quality quality = BALANCED, int threads = thread_count()) {
+        auto start = std::chrono::steady_clock::now();
+        Builder b(boxes, quality == HIGH ? max_bins : 8, threads);
+        int n = boxes.size();
+        prims.resize(n);
+        nodes.clear();
+        if (n > 0) {
+            b.prims = prims.data();
+            b.tmp.resize(2*n - 1);
+            b.next = 1;
+            if (quality == FAST) b.build_lbvh(threads);
+            else {
+                AABB box, cbox;
+                b.bounds(0, n, threads, box, cbox);
+                b.build_sah(0, 0, n, box, cbox, 0, threads);
+                for (int i = 0; i < n; i++) prims[i] = b.refs[i].prim;
+            }
+            nodes.reserve(b.next);
+            flatten(b, 0);
+        }
+        stats = BVHStats();
+        stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (n > 0) measure(0, 0, 1/std::max(nodes[0].box.half_area(), 1e-20f));
+    }
+
+    // najblizi pogodak, vidi bvh_intersect
+    template <typename F> bool intersect(const Ray &ray, float &t, F hit) const;
+
+private:
+    struct BuildNode {
+        AABB box;
+        int left = -1; // prvo od dvoje djece, desno je left + 1
+        int begin, end;
+    };
+
+    struct Bin {
+        AABB box;
+        int count = 0;
+    };
+
+    struct Builder {
+        const std::vector<AABB> &boxes;
+        // kopije kutija i centroida koje SAH particionira, da binanje cita memoriju redom
+        struct Ref {
+            AABB box;
+            Vec3f c;
+            int prim;
+        };
+        std::vector<Ref> refs;
+        std::vector<BuildNode> tmp;
+        std::atomic<int> next;
+        int *prims = nullptr;
+        int bins;
+
+        Builder(const std::vector<AABB> &boxes, int bins, int threads) : boxes(boxes), refs(boxes.size()), bins(bins) {
+            int k = chunks(boxes.size(), threads);
+            parallel_for(k, [&](int c) {
+                int begin, end;
+                chunk(boxes.size(), k, c, begin, end);
+                for (int i = begin; i < end; i++) refs[i] = {boxes[i], boxes[i].center(), i};
+            }, k);
+        }
+
+        static int chunks(int n, int threads) { return std::max(1, std::min(threads, n/1024)); }
+        static void chunk(int n, int threads, int c, int &begin, int &end) {
+            int k = chunks(n, threads);
+            begin = (long long)n*c/k;
+            end = (long long)n*(c + 1)/k;
+        }
+
+        int alloc_pair() { return next.fetch_add(2); }
+
+        // dijete se gradi u novoj dretvi ako ima dovoljno posla i slobodnih dretvi
+        template <typename L, typename R> void fork(int count, int threads, L left, R right) {
+            if (threads > 1 && count > task_size) {
+                std::thread t([&]() { left(threads/2); });
+                right(threads - threads/2);
+                t.join();
+            } else {
+                left(1);
+                right(1);
+            }
+        }
+
+        // kutija primitiva i kutija centroida za [begin, end)
+        void bounds(int begin, int end, int threads, AABB &box, AABB &cbox) {
+            int n = end - begin;
+            int k = n >= parallel_bin ? chunks(n, threads) : 1;
+            if (k == 1) {
+                for (int i = begin; i < end; i++) {
+                    box.expand(refs[i].box);
+                    cbox.expand(refs[i].c);
+                }
+                return;
+            }
+            std::vector<AABB> pb(k), pc(k);
+            parallel_for(k, [&](int c) {
+                int b, e;
+                chunk(n, k, c, b, e);
+                for (int i = begin + b; i < begin + e; i++) {
+                    pb[c].expand(refs[i].box);
+                    pc[c].expand(refs[i].c);
+                }
+            }, k);
+            for (int c = 0; c < k; c++) { box.expand(pb[c]); cbox.expand(pc[c]); }
+        }
+
+        // box i cbox (kutija centroida) za [begin, end) racuna roditelj pri particioniranju
+        void build_sah(int node, int begin, int end, const AABB &box, const AABB &cbox, int depth, int threads) {
+            BuildNode &nd = tmp[node];
+            nd.begin = begin; nd.end = end;
+            nd.box = box;
+            int n = end - begin;
+            if (n == 1) return;
+
+            // malim cvorovima ne treba vise kosara nego primitiva
+            const int bins = std::min(this->bins, n);
+            int axis = -1, split = 0;
+            float best = std::numeric_limits<float>::max();
+            Vec3f lo = cbox.bounds[0], ext = cbox.bounds[1] - cbox.bounds[0], scale;
+            for (int a = 0; a < 3; a++) scale[a] = ext[a] > 0 ? bins/ext[a] : 0;
+            auto bin_of = [&](const Ref &r, int a) {
+                return std::min(bins - 1, int((r.c[a] - lo[a])*scale[a]));
+            };
+
+            if (std::max(ext.x, std::max(ext.y, ext.z)) > 0) {
+                // kosare po dijelovima raspona, za velike cvorove svaka dretva svoj dio
+                auto fill = [&](int b, int e, Bin *local) {
+                    for (int i = b; i < e; i++) {
+                        for (int a = 0; a < 3; a++) {
+                            if (ext[a] <= 0) continue;
+                            Bin &bin = local[a*bins + bin_of(refs[i], a)];
+                            bin.box.expand(refs[i].box);
+                            bin.count++;
+                        }
+                    }
+                };
+                Bin all[3*max_bins];
+                int k = n >= parallel_bin ? chunks(n, threads) : 1;
+                if (k == 1) fill(begin, end, all);
+                else {
+                    std::vector<Bin> parts(k*3*bins);
+                    parallel_for(k, [&](int c) {
+                        int b, e;
+                        chunk(n, k, c, b, e);
+                        fill(begin + b, begin + e, &parts[c*3*bins]);
+                    }, k);
+                    for (int c = 0; c < k; c++) {
+                        for (int j = 0; j < 3*bins; j++) {
+                            all[j].box.expand(parts[c*3*bins + j].box);
+                            all[j].count += parts[c*3*bins + j].count;
+                        }
+                    }
+                }
+
+                // trosak podjele iza kosare j: 1 + (A_L*N_L + A_R*N_R)/A
+                float right_cost[max_bins];
+                for (int a = 0; a < 3; a++) {
+                    if (ext[a] <= 0) continue;
+                    const Bin *bin = &all[a*bins];
+                    AABB acc;
+                    int count = 0;
+                    for (int j = bins - 1; j > 0; j--) {
+                        acc.expand(bin[j].box);
+                        count += bin[j].count;
+                        right_cost[j] = acc.half_area()*count;
+                    }
+                    acc = AABB();
+                    count = 0;
+                    for (int j = 0; j < bins - 1; j++) {
+                        acc.expand(bin[j].box);
+                        count += bin[j].count;
+                        float cost = acc.half_area()*count + right_cost[j + 1];
+                        if (count > 0 && count < n && cost < best) { best = cost; axis = a; split = j + 1; }
+                    }
+                }
+                best = 1 + best/std::max(nd.box.half_area(), 1e-20f);
+            }
+
+            int mid;
+            AABB lbox, lcbox, rbox, rcbox;
+            if (axis < 0) {
+                // svi centroidi u istoj tocki, dijeli se po indeksu
+                if (n <= max_leaf || depth >= max_depth) return;
+                mid = begin + n/2;
+                for (int i = begin; i < mid; i++) lbox.expand(refs[i].box);
+                for (int i = mid; i < end; i++) rbox.expand(refs[i].box);
+                lcbox = rcbox = cbox;
+            } else {
+                if ((n <= max_leaf && n <= best) || depth >= max_depth) return;
+                // particija koja usput skuplja kutije obje strane, svaki element se klasificira jednom
+                int i = begin, j = end - 1;
+                while (i <= j) {
+                    if (bin_of(refs[i], axis) < split) {
+                        lbox.expand(refs[i].box);
+                        lcbox.expand(refs[i].c);
+                        i++;
+                    } else {
+                        rbox.expand(refs[i].box);
+                        rcbox.expand(refs[i].c);
+                        std::swap(refs[i], refs[j--]);
+                    }
+                }
+                mid = i;
+            }
+
+            int left = alloc_pair();
+            tmp[node].left = left;
+            fork(n, threads,
+                 [&](int t) { build_sah(left, begin, mid, lbox, lcbox, depth + 1, t); },
+                 [&](int t) { build_sah(left + 1, mid, end, rbox, rcbox, depth + 1, t); });
+        }
+
+        // 30-bitni Mortonov kod, 10 bitova po osi
+        static uint32_t spread_bits(uint32_t x) {
+            x = (x | (x << 16)) & 0x030000FF;
+            x = (x | (x << 8)) & 0x0300F00F;
+            x = (x | (x << 4)) & 0x030C30C3;
+            x = (x | (x << 2)) & 0x09249249;
+            return x;
+        }
+
+        std::vector<uint32_t> codes; // poredani kodovi, paralelno s prims
+
+        void build_lbvh(int threads) {
+            int n = boxes.size();
+            AABB box, cbox;
+            bounds(0, n, threads, box, cbox);
+            Vec3f lo = cbox.bounds[0], ext = cbox.bounds[1] - cbox.bounds[0];
+            std::vector<uint64_t> keys(n), scratch(n);
+            int k = chunks(n, threads);
+            parallel_for(k, [&](int c) {
+                int b, e;
+                chunk(n, k, c, b, e);
+                for (int i = b; i < e; i++) {
+                    uint32_t q[3];
+                    for (int a = 0; a < 3; a++)
+                        q[a] = ext[a] > 0 ? std::min(1023u, uint32_t((refs[i].c[a] - lo[a])/ext[a]*1024)) : 0;
+                    uint64_t code = spread_bits(q[0]) << 2 | spread_bits(q[1]) << 1 | spread_bits(q[2]);
+                    keys[i] = code << 32 | (uint32_t)i;
+                }
+            }, k);
+
+            // LSD radix sort po 8 bitova koda; histogrami po dijelovima pa je raspodjela stabilna
+            std::vector<int> hist(k*256);
+            for (int shift = 32; shift < 64; shift += 8) {
+                std::fill(hist.begin(), hist.end(), 0);
+                parallel_for(k, [&](int c) {
+                    int b, e;
+                    chunk(n, k, c, b, e);
+                    for (int i = b; i < e; i++) hist[c*256 + ((keys[i] >> shift) & 255)]++;
+                }, k);
+                int sum = 0;
+                for (int d = 0; d < 256; d++) {
+                    for (int c = 0; c < k; c++) {
+                        int h = hist[c*256 + d];
+                        hist[c*256 + d] = sum;
+                        sum += h;
+                    }
+                }
+                parallel_for(k, [&](int c) {
+                    int b, e;
+                    chunk(n, k, c, b, e);
+                    int *offset = &hist[c*256];
+                    for (int i = b; i < e; i++) scratch[offset[(keys[i] >> shift) & 255]++] = keys[i];
+                }, k);
+                keys.swap(scratch);
+            }
+            codes.resize(n);
+            for (int i = 0; i < n; i++) {
+                prims[i] = keys[i] & 0xFFFFFFFF;
+                codes[i] = keys[i] >> 32;
+            }
+            build_lbvh(0, 0, n, 0, threads);
+        }
+
+        // podjela na najvisem bitu u kojem se kodovi raspona razlikuju, kutije odozdo prema gore
+        void build_lbvh(int node, int begin, int end, int depth, int threads) {
+            BuildNode &nd = tmp[node];
+            nd.begin = begin; nd.end = end;
+            int n = end - begin;
+            if (n <= max_leaf || depth >= max_depth) {
+                for (int i = begin; i < end; i++) nd.box.expand(boxes[prims[i]]);
+                return;
+            }
+            uint32_t first = codes[begin], last = codes[end - 1];
+            int mid;
+            if (first == last) mid = begin + n/2;
+            else {
+                uint32_t bit = 1u << (31 - __builtin_clz(first ^ last));
+                mid = std::partition_point(codes.begin() + begin, codes.begin() + end,
+                                           [&](uint32_t c) { return !(c & bit); }) - codes.begin();
+            }
+            int left = alloc_pair();
+            nd.left = left;
+            fork(n, threads,
+                 [&](int t) { build_lbvh(left, begin, mid, depth + 1, t); },
+                 [&](int t) { build_lbvh(left + 1, mid, end, depth + 1, t); });
+            tmp[node].box = tmp[left].box;
+            tmp[node].box.expand(tmp[left + 1].box);
+        }
+    };
+
+    void flatten(const Builder &b, int i) {
+        const BuildNode &t = b.tmp[i];
+        int index = nodes.size();
+        nodes.push_back({t.box, t.begin, t.left < 0 ? t.end - t.begin : 0});
+        if (t.left < 0) return;
+        flatten(b, t.left);
+        nodes[index].offset = nodes.size();
+        flatten(b, t.left + 1);
+    }
+
+    void measure(int i, int depth, float inv_root) {
+        const BVHNode &n = nodes[i];
+        stats.nodes++;
+        stats.depth = std::max(stats.depth, depth);
+        float p = n.box.half_area()*inv_root;
+        if (n.leaf()) {
+            stats.leaves++;
+            stats.sah_cost += p*n.count;
+            return;
+        }
+        stats.sah_cost += p;
+        measure(i + 1, depth + 1, inv_root);
+        measure(n.offset, depth + 1, inv_root);
+    }
+};
+
+// obilazak stabla zadanog nizom cvorova (iz BVH-a ili mapirane datoteke); hit(i, best) testira
+// primitiv na mjestu i u poretku listova, smanjuje best i vraca true ako je pogodak blizi. Cvorovi
+// dalji od best se preskacu; any zavrsava na prvom pogotku (zrake sjene)
+template <bool any, typename F> bool bvh_traverse(const BVHNode *nodes, const Ray &ray, float &best, F hit) {
+    struct Entry { int node; float tnear; } stack[BVH::max_depth + 1];
+    int sp = 0;
+    float tnear, tfar;
+    if (!nodes[0].box.ray_intersect(ray, tnear, tfar) || tnear > best) return false;
+    bool found = false;
+    stack[sp++] = {0, tnear};
+    while (sp > 0) {
+        Entry e = stack[--sp];
+        if (e.tnear > best) continue;
+        const BVHNode *node = &nodes[e.node];
+        while (!node->leaf()) {
+            int a = node - nodes + 1, b = node->offset;
+            float ta, tb;
+            bool ha = nodes[a].box.ray_intersect(ray, ta, tfar) && ta <= best;
+            bool hb = nodes[b].box.ray_intersect(ray, tb, tfar) && tb <= best;
+            if (ha && hb) {
+                if (tb < ta) { std::swap(a, b); std::swap(ta, tb); }
+                stack[sp++] = {b, tb};
+            } else if (hb) a = b;
+            else if (!ha) break;
+            node = &nodes[a];
+        }
+        if (!node->leaf()) continue;
+        for (int i = node->offset; i < node->offset + node->count; i++) {
+            if (!hit(i, best)) continue;
+            if (any) return true;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// najblizi pogodak
+template <typename F> bool bvh_intersect(const BVHNode *nodes, const Ray &ray, float &t, F hit) {
+    float best = std::numeric_limits<float>::max();
+    if (!bvh_traverse<false>(nodes, ray, best, hit)) return false;
+    t = best;
+    return true;
+}
+
+// postoji li ikakav pogodak s t < tmax
+template <typename F> bool bvh_occluded(const BVHNode *nodes, const Ray &ray, float tmax, F hit) {
+    return bvh_traverse<true>(nodes, ray, tmax, hit);
+}
+
+template <typename F> bool BVH::intersect(const Ray &ray, float &t, F hit) const {
+    return !nodes.empty() && bvh_intersect(nodes.data(), ray, t, hit);
+}
+
+// Sazeti cvor sirokog BVH-a s 4 djece, tocno jedna linija cachea. Kutije djece su kvantizirane na
+// 8 bitova unutar kutije roditelja: min = origin + q*2^exp, zaokruzeno prema van pa su konzervativne.
+struct alignas(64) QBVHNode {
+    enum { EMPTY = 0, INTERIOR = 255 }; // meta, inace broj primitiva u listu
+    float origin[3];
+    int8_t exp[3];
+    uint8_t meta[4];
+    uint8_t qlo[3][4], qhi[3][4]; // [os][dijete]
+    int32_t child[4];             // indeks cvora ili prvi primitiv lista
+};
+static_assert(sizeof(QBVHNode) == 64, "QBVHNode mora stati u liniju cachea");
+
+// Siroki kvantizirani BVH, dobiva se sazimanjem binarnog: svaki cvor upija djecu najvece povrsine
+// dok ih ne bude 4. Poredak primitiva je isti kao u binarnom stablu. Zauzima oko trecine memorije.
+struct QBVH {
+    std::vector<QBVHNode> nodes;
+
+    void build(const BVH &bvh) {
+        nodes.clear();
+        if (bvh.nodes.empty()) return;
+        if (bvh.nodes[0].leaf()) {
+            // korijen je list, cvor s jednim djetetom
+            nodes.emplace_back();
+            int slots[1] = {0};
+            fill(bvh, 0, slots, 1);
+        } else collapse(bvh, 0);
+    }
+
+private:
+    static const int max_leaf = 254;
+
+    int collapse(const BVH &bvh, int b) {
+        int slots[4] = {b + 1, bvh.nodes[b].offset}, n = 2;
+        while (n < 4) {
+            int best = -1;
+            float area = -1;
+            for (int i = 0; i < n; i++) {
+                const BVHNode &c = bvh.nodes[slots[i]];
+                if (!c.leaf() && c.box.half_area() > area) { area = c.box.half_area(); best = i; }
+            }
+            if (best < 0) break;
+            int c = slots[best];
+            slots[best] = c + 1;
+            slots[n++] = bvh.nodes[c].offset;
+        }
+        int index = nodes.size();
+        nodes.emplace_back();
+        fill(bvh, index, slots, n);
+        return index;
+    }
+
+    void fill(const BVH &bvh, int index, const int *slots, int n) {
+        AABB parent;
+        for (int i = 0; i < n; i++) parent.expand(bvh.nodes[slots[i]].box);
+        QBVHNode q;
+        memset(&q, 0, sizeof(q));
+        for (int a = 0; a < 3; a++) {
+            float lo = parent.bounds[0][a], ext = parent.bounds[1][a] - lo;
+            int e = ext > 0 ? (int)std::ceil(std::log2(ext/255)) : -100;
+            e = std::max(-100, std::min(100, e));
+            if (ext > 0 && std::ldexp(255.f, e) < ext) e++;
+            q.origin[a] = lo;
+            q.exp[a] = e;
+        }
+        for (int i = 0; i < n; i++) {
+            const BVHNode &c = bvh.nodes[slots[i]];
+            for (int a = 0; a < 3; a++) {
+                float scale = std::ldexp(1.f, q.exp[a]);
+                int l = (int)std::floor((c.box.bounds[0][a] - q.origin[a])/scale);
+                int h = (int)std::ceil((c.box.bounds[1][a] - q.origin[a])/scale);
+                l = std::max(0, std::min(255, l));
+                h = std::max(0, std::min(255, h));
+                // zaokruzivanje u floatu ne smije suziti kutiju
+                while (l > 0 && q.origin[a] + l*scale > c.box.bounds[0][a]) l--;
+                while (h < 255 && q.origin[a] + h*scale < c.box.bounds[1][a]) h++;
+                q.qlo[a][i] = l;
+                q.qhi[a][i] = h;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            const BVHNode &c = bvh.nodes[slots[i]];
+            if (c.leaf() && c.count <= max_leaf) {
+                q.meta[i] = c.count;
+                q.child[i] = c.offset;
+            } else q.meta[i] = QBVHNode::INTERIOR;
+        }
+        nodes[index] = q;
+        for (int i = 0; i < n; i++) {
+            const BVHNode &c = bvh.nodes[slots[i]];
+            if (q.meta[i] != QBVHNode::INTERIOR) continue;
+            int child = c.leaf() ? split_leaf(c) : collapse(bvh, slots[i]);
+            nodes[index].child[i] = child;
+        }
+    }
+
+    // list s vise primitiva nego sto stane u meta (samo kod degeneriranih mreza na najvecoj dubini)
+    // dijeli se na cvor s cetiri lista iste kutije
+    int split_leaf(const BVHNode &leaf) {
+        BVH tmp;
+        int n = std::min(4, leaf.count), first = leaf.offset;
+        tmp.nodes.resize(n);
+        int slots[4];
+        for (int i = 0; i < n; i++) {
+            int end = leaf.offset + (long long)leaf.count*(i + 1)/n;
+            tmp.nodes[i] = {leaf.box, first, end - first};
+            first = end;
+            slots[i] = i;
+        }
+        int index = nodes.size();
+        nodes.emplace_back();
+        fill(tmp, index, slots, n);
+        return index;
+    }
+};
+
+// zraka s konstantama za test kvantiziranih kutija
+struct QBVHRay {
+    const Ray &ray;
+    explicit QBVHRay(const Ray &ray) : ray(ray) {}
+
+    // maska djece koju zraka sijece prije best i njihove udaljenosti ulaska
+    int test(const QBVHNode &n, float best, float tnear[4]) const {
+        float a[3], b[3];
+        for (int k = 0; k < 3; k++) {
+            float scale;
+            uint32_t bits = uint32_t(n.exp[k] + 127) << 23;
+            memcpy(&scale, &bits, 4);
+            a[k] = scale*ray.inv_dir[k];
+            b[k] = (n.origin[k] - ray.orig[k])*ray.inv_dir[k];
+        }
+#ifdef QBVH_SSE
+        __m128 tn = _mm_setzero_ps(), tf = _mm_set1_ps(best);
+        const __m128i zero = _mm_setzero_si128();
+        for (int k = 0; k < 3; k++) {
+            const uint8_t *near = ray.sign[k] ? n.qhi[k] : n.qlo[k], *far = ray.sign[k] ? n.qlo[k] : n.qhi[k];
+            int32_t qn, qf;
+            memcpy(&qn, near, 4);
+            memcpy(&qf, far, 4);
+            __m128 fn = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(qn), zero), zero));
+            __m128 ff = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(qf), zero), zero));
+            __m128 ak = _mm_set1_ps(a[k]), bk = _mm_set1_ps(b[k]);
+            // kao u AABB::ray_intersect, NaN (0*inf) je prvi argument pa ga max/min ignoriraju
+            tn = _mm_max_ps(_mm_add_ps(_mm_mul_ps(fn, ak), bk), tn);
+            tf = _mm_min_ps(_mm_add_ps(_mm_mul_ps(ff, ak), bk), tf);
+        }
+        _mm_storeu_ps(tnear, tn);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; i++) {
+            float tn = 0, tf = best;
+            for (int k = 0; k < 3; k++) {
+                float t0 = (ray.sign[k] ? n.qhi[k][i] : n.qlo[k][i])*a[k] + b[k];
+                float t1 = (ray.sign[k] ? n.qlo[k][i] : n.qhi[k][i])*a[k] + b[k];
+                tn = std::max(tn, t0);
+                tf = std::min(tf, t1);
+            }
+            tnear[i] = tn;
+            if (tn <= tf) mask |= 1 << i;
+        }
+#endif
+        for (int i = 0; i < 4; i++) if (n.meta[i] == QBVHNode::EMPTY) mask &= ~(1 << i);
+        return mask;
+    }
+};
+
+// isto kao bvh_traverse, ali nad sirokim kvantiziranim stablom; djeca se obilaze od najblizeg
+template <bool any, typename F> bool qbvh_traverse(const QBVHNode *nodes, const Ray &ray, float &best, F hit) {
+    struct Entry { int index, count; float tnear; } stack[3*BVH::max_depth + 4];
+    int sp = 0;
+    bool found = false;
+    QBVHRay q(ray);
+    stack[sp++] = {0, 0, 0};
+    while (sp > 0) {
+        Entry e = stack[--sp];
+        if (e.tnear > best) continue;
+        if (e.count > 0) {
+            for (int i = e.index; i < e.index + e.count; i++) {
+                if (!hit(i, best)) continue;
+                if (any) return true;
+                found = true;
+            }
+            continue;
+        }
+        const QBVHNode &n = nodes[e.index];
+        float tnear[4];
+        int mask = q.test(n, best, tnear);
+        // pogodena djeca poredana od najdaljeg, da najblize bude na vrhu stoga
+        Entry hits[4];
+        int k = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i))) continue;
+            Entry c = {n.child[i], n.meta[i] == QBVHNode::INTERIOR ? 0 : n.meta[i], tnear[i]};
+            int j = k++;
+            for (; j > 0 && hits[j - 1].tnear < c.tnear; j--) hits[j] = hits[j - 1];
+            hits[j] = c;
+        }
+        for (int i = 0; i < k; i++) stack[sp++] = hits[i];
+    }
+    return found;
+}
+
+template <typename F> bool qbvh_intersect(const QBVHNode *nodes, const Ray &ray, float &t, F hit) {
+    float best = std::numeric_limits<float>::max();
+    if (!qbvh_traverse<false>(nodes, ray, best, hit)) return false;
+    t = best;
+    return true;
+}
+
+template <typename F> bool qbvh_occluded(const QBVHNode *nodes, const Ray &ray, float tmax, F hit) {
+    return qbvh_traverse<true>(nodes, ray, tmax, hit);
+}
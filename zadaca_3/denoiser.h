@@ -0,0 +1,152 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "geometry.h"
+#include "parallel.h"
+#include "arena.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DENOISER_SSE
+#endif
+
+// pomocni bufferi prvog pogotka, popunjava ih render()
+struct AuxBuffers {
+    std::vector<Vec3f> albedo;
+    std::vector<Vec3f> normal; // za promasaje -dir, da tezine ostanu definirane
+    std::vector<float> depth;  // za promasaje miss_depth
+    static constexpr float miss_depth = 1e6f;
+    void resize(size_t n) {
+        albedo.assign(n, Vec3f());
+        normal.assign(n, Vec3f());
+        depth.assign(n, miss_depth);
+    }
+};
+
+// prvi pogodak jedne zrake kamere
+struct AuxSample {
+    Vec3f albedo, normal;
+    float depth = AuxBuffers::miss_depth;
+};
+
+// e^x za x <= 0 kao (1 + x/16)^16, bez grananja
+inline float fast_exp_neg(float x) {
+    float t = std::max(0.f, 1.f + x*(1.f/16));
+    t *= t; t *= t; t *= t; t *= t;
+    return t;
+}
+
+#ifdef DENOISER_SSE
+// isto za 4 vrijednosti, istim redom operacija pa je rezultat jednak skalarnom
+inline __m128 fast_exp_neg(__m128 x) {
+    __m128 t = _mm_max_ps(_mm_setzero_ps(), _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(x, _mm_set1_ps(1.f/16))));
+    t = _mm_mul_ps(t, t); t = _mm_mul_ps(t, t); t = _mm_mul_ps(t, t); t = _mm_mul_ps(t, t);
+    return t;
+}
+#endif
+
+// edge-aware a-trous wavelet filtar (Dammertz et al. 2010): B3 spline 5x5 jezgra
+// s korakom 2^i, tezine ovise o razlici boje, albeda, normale i dubine
+struct Denoiser {
+    int iterations;
+    float sigma_color;  // polovi se svakom iteracijom
+    float sigma_albedo;
+    float sigma_depth;  // po jedinici koraka jezgre
+
+    Denoiser(const int& iterations = 4, const float& sigma_color = 0.5, const float& sigma_albedo = 0.1, const float& sigma_depth = 0.5) : iterations(iterations), sigma_color(sigma_color), sigma_albedo(sigma_albedo), sigma_depth(sigma_depth) {}
+
+    void apply(std::vector<Vec3f>& beauty, const AuxBuffers& aux, int width, int height) const {
+        const size_t n = (size_t)width*height;
+        // SoA kopije da su unutarnje petlje po x kontinuirane
+        std::vector<float> c[3], tmp[3], a[3], nr[3], z(aux.depth);
+        for (int k = 0; k < 3; k++) {
+            c[k].resize(n); tmp[k].resize(n); a[k].resize(n); nr[k].resize(n);
+            for (size_t i = 0; i < n; i++) {
+                c[k][i] = beauty[i][k];
+                a[k][i] = aux.albedo[i][k];
+                nr[k][i] = aux.normal[i][k];
+            }
+        }
+        const float h[5] = {1.f/16, 1.f/4, 3.f/8, 1.f/4, 1.f/16};
+        std::vector<Arena> arenas(thread_count()); // akumulatori reda, bez alokacija po redu
+
+        for (int it = 0; it < iterations; it++) {
+            const int step = 1 << it;
+            const float sc = sigma_color / step;
+            const float inv_c = 1.f/(sc*sc), inv_a = 1.f/(sigma_albedo*sigma_albedo), inv_z = 1.f/(sigma_depth*step);
+
+            parallel_for_indexed(height, [&](int y, int thread) {
+                Arena &arena = arenas[thread];
+                arena.reset();
+                float *acc[4];
+                for (auto &v : acc) v = arena.alloc<float>(width, 0.f);
+                const size_t row = (size_t)y*width;
+                for (int ky = -2; ky <= 2; ky++) {
+                    int yy = y + ky*step;
+                    if (yy < 0 || yy >= height) continue;
+                    for (int kx = -2; kx <= 2; kx++) {
+                        const int dx = kx*step;
+                        const int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+                        const float hk = h[kx + 2]*h[ky + 2];
+                        const float *cr = &c[0][row], *cg = &c[1][row], *cb = &c[2][row];
+                        const float *ar = &a[0][row], *ag = &a[1][row], *ab = &a[2][row];
+                        const float *nx = &nr[0][row], *ny = &nr[1][row], *nz = &nr[2][row], *zp = &z[row];
+                        const size_t qrow = (size_t)yy*width;
+                        const float *qr = &c[0][qrow], *qg = &c[1][qrow], *qb = &c[2][qrow];
+                        const float *qar = &a[0][qrow], *qag = &a[1][qrow], *qab = &a[2][qrow];
+                        const float *qnx = &nr[0][qrow], *qny = &nr[1][qrow], *qnz = &nr[2][qrow], *qz = &z[qrow];
+                        float *sr = acc[0], *sg = acc[1], *sb = acc[2], *sw = acc[3];
+                        int x = x0;
+#ifdef DENOISER_SSE
+                        // 4 piksela odjednom, ostatak reda ide skalarno
+                        const __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.f);
+                        const __m128 hk4 = _mm_set1_ps(hk), ic = _mm_set1_ps(inv_c), ia = _mm_set1_ps(inv_a), iz = _mm_set1_ps(inv_z);
+                        for (; x + 4 <= x1; x += 4) {
+                            const int q = x + dx;
+                            __m128 wn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(nx + x), _mm_loadu_ps(qnx + q)),
+                                                              _mm_mul_ps(_mm_loadu_ps(ny + x), _mm_loadu_ps(qny + q))),
+                                                   _mm_mul_ps(_mm_loadu_ps(nz + x), _mm_loadu_ps(qnz + q)));
+                            wn = _mm_max_ps(zero, wn);
+                            wn = _mm_mul_ps(wn, wn); wn = _mm_mul_ps(wn, wn); wn = _mm_mul_ps(wn, wn); wn = _mm_mul_ps(wn, wn); wn = _mm_mul_ps(wn, wn);
+                            __m128 vr = _mm_loadu_ps(qr + q), vg = _mm_loadu_ps(qg + q), vb = _mm_loadu_ps(qb + q);
+                            __m128 dr = _mm_sub_ps(_mm_loadu_ps(cr + x), vr), dg = _mm_sub_ps(_mm_loadu_ps(cg + x), vg), db = _mm_sub_ps(_mm_loadu_ps(cb + x), vb);
+                            __m128 er = _mm_sub_ps(_mm_loadu_ps(ar + x), _mm_loadu_ps(qar + q));
+                            __m128 eg = _mm_sub_ps(_mm_loadu_ps(ag + x), _mm_loadu_ps(qag + q));
+                            __m128 eb = _mm_sub_ps(_mm_loadu_ps(ab + x), _mm_loadu_ps(qab + q));
+                            __m128 ez = _mm_or_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(zp + x), _mm_loadu_ps(qz + q))), sign); // -|dz|
+                            __m128 dc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                            __m128 da = _mm_add_ps(_mm_add_ps(_mm_mul_ps(er, er), _mm_mul_ps(eg, eg)), _mm_mul_ps(eb, eb));
+                            __m128 w = _mm_mul_ps(hk4, wn);
+                            w = _mm_mul_ps(w, fast_exp_neg(_mm_mul_ps(ez, iz)));
+                            w = _mm_mul_ps(w, fast_exp_neg(_mm_mul_ps(_mm_xor_ps(dc, sign), ic)));
+                            w = _mm_mul_ps(w, fast_exp_neg(_mm_mul_ps(_mm_xor_ps(da, sign), ia)));
+                            _mm_storeu_ps(sr + x, _mm_add_ps(_mm_loadu_ps(sr + x), _mm_mul_ps(w, vr)));
+                            _mm_storeu_ps(sg + x, _mm_add_ps(_mm_loadu_ps(sg + x), _mm_mul_ps(w, vg)));
+                            _mm_storeu_ps(sb + x, _mm_add_ps(_mm_loadu_ps(sb + x), _mm_mul_ps(w, vb)));
+                            _mm_storeu_ps(sw + x, _mm_add_ps(_mm_loadu_ps(sw + x), w));
+                        }
+#endif
+                        for (; x < x1; x++) {
+                            float wn = std::max(0.f, nx[x]*qnx[x + dx] + ny[x]*qny[x + dx] + nz[x]*qnz[x + dx]);
+                            wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn; // ^32
+                            float dr = cr[x] - qr[x + dx], dg = cg[x] - qg[x + dx], db = cb[x] - qb[x + dx];
+                            float er = ar[x] - qar[x + dx], eg = ag[x] - qag[x + dx], eb = ab[x] - qab[x + dx];
+                            float w = hk * wn
+                                    * fast_exp_neg(-std::abs(zp[x] - qz[x + dx])*inv_z)
+                                    * fast_exp_neg(-(dr*dr + dg*dg + db*db)*inv_c)
+                                    * fast_exp_neg(-(er*er + eg*eg + eb*eb)*inv_a);
+                            sr[x] += w*qr[x + dx]; sg[x] += w*qg[x + dx]; sb[x] += w*qb[x + dx]; sw[x] += w;
+                        }
+                    }
+                }
+                for (int x = 0; x < width; x++) {
+                    float inv = acc[3][x] > 0 ? 1.f/acc[3][x] : 0.f;
+                    for (int k = 0; k < 3; k++) tmp[k][row + x] = acc[3][x] > 0 ? acc[k][x]*inv : c[k][row + x];
+                }
+            }, arenas.size());
+            for (int k = 0; k < 3; k++) std::swap(c[k], tmp[k]);
+        }
+
+        for (size_t i = 0; i < n; i++) beauty[i] = Vec3f(c[0][i], c[1][i], c[2][i]);
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "geometry.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HDR_SSE
+#endif
+
+static_assert(sizeof(Vec3f) == 3*sizeof(float), "Vec3f mora biti tri uzastopna floata");
+
+// float slika u PFM formatu (little endian, redovi od dna prema vrhu)
+inline bool write_pfm(const std::string& filename, const std::vector<Vec3f>& buffer, int width, int height) {
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs) return false;
+    ofs << "PF\n" << width << " " << height << "\n-1.0\n";
+    for (int y = height - 1; y >= 0; y--) {
+        ofs.write(reinterpret_cast<const char*>(&buffer[(size_t)y*width]), sizeof(Vec3f)*width);
+    }
+    return (bool)ofs;
+}
+
+#ifdef HDR_SSE
+namespace hdr_detail {
+
+// log2 za pozitivne normalne x: eksponent plus red za log2 mantise preko t = (m - 1)/(m + 1)
+inline __m128 log2_ps(__m128 x) {
+    const __m128 one = _mm_set1_ps(1.f);
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_castps_si128(one)));
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 p = _mm_set1_ps(1.f/9);
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/7));
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/5));
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/3));
+    p = _mm_add_ps(_mm_mul_ps(p, t2), one);
+    return _mm_add_ps(e, _mm_mul_ps(_mm_mul_ps(t, p), _mm_set1_ps(2.8853900817779268f))); // 2/ln 2
+}
+
+// 2^y za y >= -126: najblizi cijeli ide u eksponent, ostatak iz [-0.5, 0.5] Taylorovim redom
+inline __m128 exp2_ps(__m128 y) {
+    y = _mm_max_ps(y, _mm_set1_ps(-126.f));
+    __m128i i = _mm_cvtps_epi32(y);
+    __m128 z = _mm_mul_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(i)), _mm_set1_ps(0.6931471805599453f));
+    __m128 p = _mm_set1_ps(1.f/720);
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.f/120));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.f/24));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.f/6));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(0.5f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.f));
+    return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23)));
+}
+
+}
+#endif
+
+// HDR -> 8 bit; operator se bira izvan petlje, a svaka petlja obraduje 4 vrijednosti sa SSE2
+// (ostatak i gradnje bez SSE-a skalarno). Gama se racuna kao 2^(log2(v)/gamma) s relativnom
+// greskom oko 1e-6, pa se od std::pow razlikuje najvise za jednu razinu, i to rijetko
+struct ToneMapper {
+    enum Operator { CLAMP, REINHARD, ACES };
+    Operator op;
+    float exposure; // u f-stopovima, mnozi s 2^exposure
+    float gamma;
+
+    ToneMapper(const Operator& op = CLAMP, const float& exposure = 0, const float& gamma = 1) : op(op), exposure(exposure), gamma(gamma) {}
+
+    void apply(const std::vector<Vec3f>& hdr, std::vector<unsigned char>& ldr) const {
+        const size_t n = hdr.size()*3;
+        const float *in = reinterpret_cast<const float*>(hdr.data());
+        std::vector<float> v(n);
+        const float scale = std::exp2(exposure);
+        size_t i = 0;
+#ifdef HDR_SSE
+        const __m128 s4 = _mm_set1_ps(scale), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+#endif
+        switch (op) {
+        case CLAMP:
+#ifdef HDR_SSE
+            for (; i + 4 <= n; i += 4) _mm_storeu_ps(&v[i], _mm_mul_ps(_mm_loadu_ps(in + i), s4));
+#endif
+            for (; i < n; i++) v[i] = in[i]*scale;
+            break;
+        case REINHARD:
+#ifdef HDR_SSE
+            for (; i + 4 <= n; i += 4) {
+                __m128 x = _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(in + i), s4));
+                _mm_storeu_ps(&v[i], _mm_div_ps(x, _mm_add_ps(one, x)));
+            }
+#endif
+            for (; i < n; i++) {
+                float x = std::max(0.f, in[i]*scale);
+                v[i] = x/(1.f + x);
+            }
+            break;
+        case ACES: // Narkowicz 2015
+#ifdef HDR_SSE
+            for (; i + 4 <= n; i += 4) {
+                __m128 x = _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(in + i), s4));
+                __m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+                __m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+                _mm_storeu_ps(&v[i], _mm_div_ps(num, den));
+            }
+#endif
+            for (; i < n; i++) {
+                float x = std::max(0.f, in[i]*scale);
+                v[i] = (x*(2.51f*x + 0.03f))/(x*(2.43f*x + 0.59f) + 0.14f);
+            }
+            break;
+        }
+        if (gamma != 1) {
+            const float inv = 1.f/gamma;
+            i = 0;
+#ifdef HDR_SSE
+            // rezultat se ionako sijece na [0, 1], pa se v prvo ogranici na [najmanji normalni float, 1]
+            const __m128 inv4 = _mm_set1_ps(inv), tiny = _mm_set1_ps(1.17549435e-38f);
+            for (; i + 4 <= n; i += 4) {
+                __m128 x = _mm_min_ps(one, _mm_max_ps(tiny, _mm_loadu_ps(&v[i])));
+                _mm_storeu_ps(&v[i], hdr_detail::exp2_ps(_mm_mul_ps(hdr_detail::log2_ps(x), inv4)));
+            }
+#endif
+            for (; i < n; i++) v[i] = std::pow(std::max(0.f, v[i]), inv);
+        }
+        ldr.resize(n);
+        i = 0;
+#ifdef HDR_SSE
+        const __m128 s255 = _mm_set1_ps(255.f);
+        for (; i + 4 <= n; i += 4) {
+            __m128i q = _mm_cvttps_epi32(_mm_mul_ps(s255, _mm_max_ps(zero, _mm_min_ps(one, _mm_loadu_ps(&v[i])))));
+            q = _mm_packs_epi32(q, q);
+            int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+            std::memcpy(&ldr[i], &bytes, 4);
+        }
+#endif
+        for (; i < n; i++) ldr[i] = (unsigned char)(255.f * std::max(0.f, std::min(1.f, v[i])));
+    }
+};
@@ -0,0 +1,454 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include "geometry.h"
+#include "bvh.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// 64-bitni hash po 8 bajtova (mijesanje iz murmur3 fmix64), dovoljno brz za hashiranje cijelog OBJ-a
+inline uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33; h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0) {
+    const unsigned char *p = (const unsigned char*)data;
+    uint64_t h = seed ^ (size*0x9E3779B97F4A7C15ull);
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ hash_mix(w))*0x9E3779B97F4A7C15ull;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, size);
+    return hash_mix(h ^ hash_mix(w));
+}
+
+// hash sadrzaja datoteke; na POSIX-u preko mmap-a, pa se za pogodak u cacheu izvor ne kopira u memoriju
+inline bool hash_file(const std::string &filename, uint64_t seed, uint64_t &hash) {
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = p != MAP_FAILED;
+        if (ok) {
+            hash = hash_bytes(p, st.st_size, seed);
+            munmap(p, st.st_size);
+        }
+    } else if (ok) hash = hash_bytes(nullptr, 0, seed);
+    ::close(fd);
+    return ok;
+#else
+    std::ifstream file(filename, std::ifstream::binary);
+    if (!file) return false;
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    hash = hash_bytes(data.data(), data.size(), seed);
+    return true;
+#endif
+}
+
+// Zaglavlje datoteke cachea. Sve sekcije su zadane pomakom od pocetka datoteke (0 ako je nema)
+// i poravnate na 64 bajta, pa se datoteka moze mapirati na bilo koju adresu i koristiti bez kopiranja.
+struct MeshCacheHeader {
+    enum Section {
+        POSITIONS, // Vec3f po vrhu
+        NORMALS,   // Vec3f po vrhu
+        UVS,       // Vec2f po vrhu
+        FACES,     // 3 indeksa vrhova po trokutu, u poretku listova BVH-a
+        TRIANGLES, // klasteri po cluster_size trokuta, svaki SoA za presjek: v0.x, v0.y, v0.z, e1.x, ..., e2.z
+        NODES,     // BVHNode, ako je mreza spremljena s binarnim stablom
+        WIDE_NODES, // QBVHNode, ako je spremljena sa sirokim kvantiziranim
+        SECTIONS
+    };
+    // klaster je cijeli broj stranica od 4K i sekcija je poravnata na 4K, pa se klasteri mogu
+    // mapirati pojedinacno (out-of-core nacin); poredak listova BVH-a ih cini prostorno bliskima.
+    // Na jezgrama s vecim stranicama ClusterCache mapira od prethodne granice stranice
+    static const int cluster_size = 4096;
+    static const size_t cluster_bytes = cluster_size*9*sizeof(float);
+    static const size_t page = 4096;
+    static int clusters(size_t triangles) { return (triangles + cluster_size - 1)/cluster_size; }
+    char magic[8];
+    uint64_t key;
+    uint64_t size;
+    uint32_t vertices, triangles, nodes, depth;
+    float sah_cost;
+    uint32_t wide_nodes;
+    uint64_t offset[SECTIONS];
+};
+
+// Blob s obradenom mrezom i BVH-om: ili mapirana datoteka ili bajtovi u memoriji (tek izgradeni
+// ili procitani na Windowsima), Model koristi samo pokazivace na sekcije.
+struct MeshBlob {
+    static constexpr char magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '0', '3'};
+
+    MeshBlob() {}
+    MeshBlob(const MeshBlob&) = delete;
+    MeshBlob& operator=(const MeshBlob&) = delete;
+    ~MeshBlob() { release(); }
+
+    const MeshCacheHeader& header() const { return *(const MeshCacheHeader*)data; }
+    template <typename T> const T* section(int s) const {
+        return header().offset[s] ? (const T*)(data + header().offset[s]) : nullptr;
+    }
+    bool mapped() const { return map_size > 0; }
+
+    // slaze blob u memoriji; faces su u poretku listova BVH-a. Ako je zadan wide, sprema se samo
+    // siroko stablo, a binarno sluzi za statistiku
+    void pack(uint64_t key, const std::vector<Vec3f> &positions, const std::vector<Vec3f> &normals,
+              const std::vector<Vec2f> &uvs, const std::vector<int> &faces, const BVH &bvh, const QBVH *wide = nullptr) {
+        size_t nt = faces.size()/3;
+        size_t sizes[MeshCacheHeader::SECTIONS] = {
+            positions.size()*sizeof(Vec3f), normals.size()*sizeof(Vec3f), uvs.size()*sizeof(Vec2f),
+            faces.size()*sizeof(int), MeshCacheHeader::clusters(nt)*MeshCacheHeader::cluster_bytes,
+            wide ? 0 : bvh.nodes.size()*sizeof(BVHNode), wide ? wide->nodes.size()*sizeof(QBVHNode) : 0
+        };
+        MeshCacheHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, magic, sizeof(magic));
+        h.key = key;
+        h.vertices = positions.size();
+        h.triangles = nt;
+        h.nodes = bvh.nodes.size();
+        h.depth = bvh.stats.depth;
+        h.sah_cost = bvh.stats.sah_cost;
+        h.wide_nodes = wide ? wide->nodes.size() : 0;
+        size_t size = align(sizeof(h));
+        for (int s = 0; s < MeshCacheHeader::SECTIONS; s++) {
+            if (sizes[s] == 0) continue;
+            if (s == MeshCacheHeader::TRIANGLES) size = (size + MeshCacheHeader::page - 1)/MeshCacheHeader::page*MeshCacheHeader::page;
+            h.offset[s] = size;
+            size += align(sizes[s]);
+        }
+        h.size = size;
+
+        release();
+        owned.assign(size/sizeof(Line), Line());
+        char *out = (char*)owned.data();
+        memcpy(out, &h, sizeof(h));
+        if (h.offset[0]) memcpy(out + h.offset[0], &positions[0].x, sizes[0]);
+        if (h.offset[1]) memcpy(out + h.offset[1], &normals[0].x, sizes[1]);
+        if (h.offset[2]) memcpy(out + h.offset[2], &uvs[0].x, sizes[2]);
+        if (h.offset[3]) memcpy(out + h.offset[3], faces.data(), sizes[3]);
+        if (h.offset[4]) {
+            const int K = MeshCacheHeader::cluster_size;
+            for (size_t i = 0; i < nt; i++) {
+                float *tri = (float*)(out + h.offset[4] + i/K*MeshCacheHeader::cluster_bytes);
+                size_t j = i % K;
+                const Vec3f &v0 = positions[faces[3*i]];
+                Vec3f e1 = positions[faces[3*i + 1]] - v0, e2 = positions[faces[3*i + 2]] - v0;
+                for (int k = 0; k < 3; k++) {
+                    tri[k*K + j] = v0[k];
+                    tri[(3 + k)*K + j] = e1[k];
+                    tri[(6 + k)*K + j] = e2[k];
+                }
+            }
+        }
+        if (h.offset[5]) memcpy(out + h.offset[5], (const void*)bvh.nodes.data(), sizes[5]);
+        if (h.offset[6]) memcpy(out + h.offset[6], (const void*)wide->nodes.data(), sizes[6]);
+        data = out;
+    }
+
+    // zapis preko privremene datoteke, pa drugi proces nikad ne vidi pola datoteke
+    bool save(const std::string &path) const {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream file(tmp, std::ofstream::binary);
+            if (!file.write(data, header().size)) return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // false ako datoteke nema, ako je za drugi kljuc (promijenjen izvor ili parametri) ili je ostecena
+    bool open(const std::string &path, uint64_t key) {
+        release();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void *p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(MeshCacheHeader))
+            p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        data = (const char*)p;
+        map_size = st.st_size;
+        size_t size = st.st_size;
+#else
+        std::ifstream file(path, std::ifstream::binary | std::ifstream::ate);
+        if (!file) return false;
+        size_t size = file.tellg();
+        if (size % sizeof(Line)) return false;
+        owned.resize(size/sizeof(Line));
+        file.seekg(0);
+        if (!file.read((char*)owned.data(), size)) return false;
+        data = (const char*)owned.data();
+#endif
+        if (!valid(size, key)) {
+            release();
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // linije cachea, da sekcije u memoriji budu poravnate kao u mapiranoj datoteci
+    struct alignas(64) Line { char bytes[64]; };
+
+    const char *data = nullptr;
+    size_t map_size = 0;
+    std::vector<Line> owned;
+
+    static size_t align(size_t n) { return (n + 63) & ~size_t(63); }
+
+    bool valid(size_t size, uint64_t key) const {
+        if (size < sizeof(MeshCacheHeader)) return false;
+        const MeshCacheHeader &h = header();
+        if (memcmp(h.magic, magic, sizeof(magic)) != 0 || h.key != key || h.size != size) return false;
+        size_t sizes[MeshCacheHeader::SECTIONS] = {
+            h.vertices*sizeof(Vec3f), h.vertices*sizeof(Vec3f), h.vertices*sizeof(Vec2f),
+            h.triangles*3*sizeof(int), MeshCacheHeader::clusters(h.triangles)*MeshCacheHeader::cluster_bytes, h.nodes*sizeof(BVHNode),
+            h.wide_nodes*sizeof(QBVHNode)
+        };
+        for (int s = 0; s < MeshCacheHeader::SECTIONS; s++)
+            if (h.offset[s] && (h.offset[s] % 64 || h.offset[s] + sizes[s] > size)) return false;
+        if (h.offset[MeshCacheHeader::TRIANGLES] % MeshCacheHeader::page) return false;
+        return h.triangles == 0 || (h.offset[MeshCacheHeader::FACES] && h.offset[MeshCacheHeader::TRIANGLES] &&
+                                    h.offset[MeshCacheHeader::POSITIONS] &&
+                                    (h.offset[MeshCacheHeader::NODES] || h.offset[MeshCacheHeader::WIDE_NODES]));
+    }
+
+    void release() {
+#ifndef _WIN32
+        if (map_size) munmap((void*)data, map_size);
+#endif
+        map_size = 0;
+        data = nullptr;
+        owned.clear();
+        owned.shrink_to_fit();
+    }
+};
+
+// Klasteri trokuta iz datoteke cachea koji se ucitavaju tek kad ih obilazak treba. Rezidentni su u
+// fiksnom broju mjesta (memory_limit/cluster_bytes), a kad ih ponestane izbacuje se najdavnije
+// koristeni klaster koji nitko ne koristi. acquire/release su thread-safe; za ucitani klaster
+// acquire samo atomicno zakljuca mjesto, a mutex se uzima tek za ucitavanje i izbacivanje.
+struct ClusterCache {
+    struct Stats {
+        long long hits = 0, page_ins = 0, evictions = 0;
+        size_t resident_bytes = 0, peak_bytes = 0;
+    };
+
+    ClusterCache() {}
+    ClusterCache(const ClusterCache&) = delete;
+    ClusterCache& operator=(const ClusterCache&) = delete;
+    ~ClusterCache() { close(); }
+
+    bool active() const { return !slots.empty(); }
+
+    // offset je pocetak sekcije TRIANGLES u datoteci. memory_limit pokriva samo mjesta za klastere;
+    // svaka dretva drzi najvise jedan klaster, pa ako ih mreza ima vise nego sto stane, mjesta mora
+    // biti barem threads + 1, inace se baca invalid_argument
+    bool open(const std::string &path, uint64_t offset, int clusters, size_t memory_limit, int threads = thread_count()) {
+        close();
+        size_t n = std::min<size_t>(clusters, memory_limit/MeshCacheHeader::cluster_bytes);
+        size_t floor = std::min<size_t>(clusters, threads + 1);
+        if (n < floor)
+            throw std::invalid_argument("ClusterCache: " + std::to_string(memory_limit/1024) + " KB za klastere, a za " +
+                                        std::to_string(threads) + " dretvi treba barem " +
+                                        std::to_string(floor*MeshCacheHeader::cluster_bytes/1024) + " KB");
+        this->path = path;
+        this->offset = offset;
+#ifndef _WIN32
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+#endif
+        slots = std::vector<Slot>(n);
+        slot_of = std::vector<std::atomic<int>>(clusters);
+        for (auto &s : slot_of) s = -1;
+        stats = Stats();
+        return true;
+    }
+
+    // pokazivac na klaster, koji ostaje ucitan dok se ne pozove release. Ako se klaster ne moze
+    // ucitati program se prekida, jer bi se inace slika dovrsila bez dijela geometrije
+    const float* acquire(int cluster) {
+        int s = slot_of[cluster].load(std::memory_order_acquire);
+        if (s >= 0 && pin(slots[s], cluster)) return (const float*)slots[s].data;
+        return page_in(cluster);
+    }
+
+    // slot_of[cluster] se ne mijenja dok je klaster zakljucan
+    void release(int cluster) {
+        unpin(slots[slot_of[cluster].load(std::memory_order_relaxed)]);
+    }
+
+    Stats statistics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats st = stats;
+        for (auto &slot : slots) st.hits += slot.hits.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    void close() {
+        for (auto &slot : slots) if (slot.cluster >= 0) unmap(slot);
+        slots.clear();
+        slot_of.clear();
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+private:
+    // pins i cluster su atomicni zbog acquire bez mutexa, mjesta su na zasebnim linijama cachea
+    struct alignas(64) Slot {
+        std::atomic<int> cluster{-1}, pins{0};
+        std::atomic<uint64_t> last_use{0};
+        std::atomic<long long> hits{0};
+        char *data = nullptr;
+        void *base = nullptr; // pocetak mapiranja, na granici stranice sustava
+        size_t length = 0;
+        std::vector<char> buffer; // bez mmap-a
+    };
+
+    std::string path;
+    uint64_t offset = 0;
+    int fd = -1;
+    std::vector<Slot> slots;
+    std::vector<std::atomic<int>> slot_of;
+    // povecava se samo pri ucitavanju, pa LRU razlikuje klastere koristene izmedu dva ucitavanja
+    std::atomic<uint64_t> clock{0};
+    std::atomic<int> waiting{0}; // dretve u page_in, release ih budi samo ako ih ima
+    Stats stats;
+    std::mutex mutex;
+    std::condition_variable available;
+
+    // zakljucavanje bez mutexa: prvo se poveca pins pa provjeri cluster, a izbacivanje obrnuto
+    // (cluster = -1 pa provjera pins), pa barem jedna strana vidi drugu
+    bool pin(Slot &slot, int cluster) {
+        slot.pins.fetch_add(1);
+        if (slot.cluster.load() == cluster) {
+            slot.hits.fetch_add(1, std::memory_order_relaxed);
+            slot.last_use.store(clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return true;
+        }
+        unpin(slot);
+        return false;
+    }
+
+    void unpin(Slot &slot) {
+        if (slot.pins.fetch_sub(1) == 1 && waiting.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            available.notify_all();
+        }
+    }
+
+    const float* page_in(int cluster) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting++;
+        bool paged = false;
+        int s;
+        while ((s = slot_of[cluster].load()) < 0) {
+            int victim = evict();
+            if (victim < 0) {
+                // sva mjesta su u upotrebi, ceka se release
+                available.wait(lock);
+                continue;
+            }
+            Slot &v = slots[victim];
+            if (!map(v, cluster)) {
+                std::fprintf(stderr, "ne mogu ucitati klaster %d iz %s: %s\n", cluster, path.c_str(), std::strerror(errno));
+                std::abort();
+            }
+            stats.page_ins++;
+            stats.resident_bytes += MeshCacheHeader::cluster_bytes;
+            stats.peak_bytes = std::max(stats.peak_bytes, stats.resident_bytes);
+            v.last_use = ++clock;
+            v.cluster = cluster;
+            slot_of[cluster] = victim;
+            paged = true;
+        }
+        // izbacuje se samo pod mutexom, pa je mjesto sigurno jos uvijek ovog klastera
+        if (!paged) stats.hits++;
+        slots[s].pins++;
+        waiting--;
+        return (const float*)slots[s].data;
+    }
+
+    // prazno mjesto ili najdavnije koristeno koje nitko ne drzi, -1 ako su sva zakljucana
+    int evict() {
+        for (;;) {
+            int victim = -1;
+            for (int i = 0; i < (int)slots.size(); i++) {
+                if (slots[i].pins > 0) continue;
+                if (victim < 0 || slots[i].cluster < 0 || slots[i].last_use < slots[victim].last_use) victim = i;
+                if (slots[i].cluster < 0) break;
+            }
+            if (victim < 0) return -1;
+            Slot &v = slots[victim];
+            int old = v.cluster;
+            if (old < 0) return victim;
+            v.cluster = -1;
+            if (v.pins > 0) {
+                // acquire ga je upravo zakljucao
+                v.cluster = old;
+                continue;
+            }
+            unmap(v);
+            slot_of[old] = -1;
+            stats.evictions++;
+            stats.resident_bytes -= MeshCacheHeader::cluster_bytes;
+            return victim;
+        }
+    }
+
+    bool map(Slot &slot, int cluster) {
+        uint64_t at = offset + (uint64_t)cluster*MeshCacheHeader::cluster_bytes;
+#ifndef _WIN32
+        static const uint64_t system_page = sysconf(_SC_PAGESIZE);
+        uint64_t skip = at % system_page;
+        void *p = mmap(nullptr, MeshCacheHeader::cluster_bytes + skip, PROT_READ, MAP_PRIVATE, fd, at - skip);
+        if (p == MAP_FAILED) return false;
+        slot.base = p;
+        slot.length = MeshCacheHeader::cluster_bytes + skip;
+        slot.data = (char*)p + skip;
+#else
+        std::ifstream file(path, std::ifstream::binary);
+        slot.buffer.resize(MeshCacheHeader::cluster_bytes);
+        file.seekg(at);
+        if (!file.read(slot.buffer.data(), slot.buffer.size())) return false;
+        slot.data = slot.buffer.data();
+#endif
+        return true;
+    }
+
+    void unmap(Slot &slot) {
+#ifndef _WIN32
+        munmap(slot.base, slot.length);
+        slot.base = nullptr;
+#endif
+        slot.data = nullptr;
+    }
+};
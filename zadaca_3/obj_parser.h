@@ -0,0 +1,172 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdlib>
+#include <cstdint>
+#include <unordered_map>
+#include <array>
+#include "geometry.h"
+
+// Mreza trokuta iz OBJ datoteke. Vrhovi su jedinstvene kombinacije (v, vt, vn) iz 'f' linija,
+// pa su pozicije, normale i UV-ovi kompaktni nizovi s istim indeksom.
+struct ObjMesh {
+    std::vector<Vec3f> positions;
+    std::vector<Vec3f> normals; // prazno ako ih datoteka nema
+    std::vector<Vec2f> uvs;     // prazno ako ih datoteka nema
+    std::vector<int> indices;   // 3 po trokutu
+
+    size_t triangles() const { return indices.size()/3; }
+
+    // glatke normale vrhova kao zbroj normala susjednih trokuta tezinski po povrsini
+    void compute_normals() {
+        normals.assign(positions.size(), Vec3f());
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            int a = indices[i], b = indices[i+1], c = indices[i+2];
+            Vec3f n = cross(positions[b] - positions[a], positions[c] - positions[a]);
+            normals[a] = normals[a] + n;
+            normals[b] = normals[b] + n;
+            normals[c] = normals[c] + n;
+        }
+        for (auto &n : normals) if (n*n > 0) n.normalize();
+    }
+};
+
+namespace obj_detail {
+
+inline const char* skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+inline const char* next_line(const char *p, const char *end) {
+    while (p < end && *p != '\n') p++;
+    return p < end ? p + 1 : end;
+}
+
+inline const char* parse_float(const char *p, const char *end, float &out) {
+    p = skip_space(p, end);
+    char *stop;
+    out = std::strtof(p, &stop);
+    return stop;
+}
+
+// indeks iz 'f' linije, negativni su relativni prema kraju; vraca 0 ako ga nema,
+// a -1 za 0 ili relativni indeks ispred pocetka niza
+inline const char* parse_index(const char *p, const char *end, int count, int &out) {
+    bool neg = false;
+    if (p < end && *p == '-') { neg = true; p++; }
+    int v = 0;
+    bool any = false;
+    while (p < end && *p >= '0' && *p <= '9') { v = v*10 + (*p - '0'); p++; any = true; }
+    out = !any ? 0 : (neg ? count - v + 1 : v);
+    if (any && out < 1) out = -1;
+    return p;
+}
+
+// kutovi bez vn (lice mijesa kutove s normalom i bez nje, ili ih neka lica nemaju) dobivaju
+// zbroj normala svojih lica, za kut samo jednog lica to je normala lica
+inline void fill_missing_normals(ObjMesh &mesh) {
+    std::vector<char> missing(mesh.normals.size(), 0);
+    bool any = false;
+    for (size_t i = 0; i < missing.size(); i++)
+        if (mesh.normals[i]*mesh.normals[i] == 0) missing[i] = any = true;
+    if (!any) return;
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+        const int *f = &mesh.indices[i];
+        Vec3f n = cross(mesh.positions[f[1]] - mesh.positions[f[0]], mesh.positions[f[2]] - mesh.positions[f[0]]);
+        for (int k = 0; k < 3; k++) if (missing[f[k]]) mesh.normals[f[k]] = mesh.normals[f[k]] + n;
+    }
+    for (size_t i = 0; i < missing.size(); i++)
+        if (missing[i] && mesh.normals[i]*mesh.normals[i] > 0) mesh.normals[i].normalize();
+}
+
+struct CornerHash {
+    size_t operator()(const std::array<int, 3> &k) const {
+        uint64_t h = (uint64_t)(uint32_t)k[0]*0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t)(uint32_t)k[1]*0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+        h ^= (uint64_t)(uint32_t)k[2]*0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+        return (size_t)h;
+    }
+};
+
+}
+
+inline bool read_file(const std::string &filename, std::string &data) {
+    std::ifstream file(filename, std::ifstream::binary | std::ifstream::ate);
+    if (!file) return false;
+    data.resize(file.tellg());
+    file.seekg(0);
+    return (bool)file.read(&data[0], data.size());
+}
+
+// Parsira sadrzaj OBJ datoteke bez stringova po liniji. Podrzava 'f a', 'f a/b', 'f a//c',
+// 'f a/b/c', negativne indekse i poligone (lepeza trokuta).
+inline bool parse_obj(const std::string &data, ObjMesh &mesh) {
+    using namespace obj_detail;
+    const char *p = data.data(), *end = p + data.size();
+
+    std::vector<Vec3f> v, vn;
+    std::vector<Vec2f> vt;
+    std::unordered_map<std::array<int, 3>, int, CornerHash> corners;
+    std::vector<int> polygon;
+    mesh = ObjMesh();
+
+    while (p < end) {
+        p = skip_space(p, end);
+        if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            Vec3f x;
+            p = parse_float(p + 1, end, x.x); p = parse_float(p, end, x.y); p = parse_float(p, end, x.z);
+            v.push_back(x);
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            Vec2f x;
+            p = parse_float(p + 2, end, x.x); p = parse_float(p, end, x.y);
+            vt.push_back(x);
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            Vec3f x;
+            p = parse_float(p + 2, end, x.x); p = parse_float(p, end, x.y); p = parse_float(p, end, x.z);
+            vn.push_back(x);
+        } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            polygon.clear();
+            while (true) {
+                p = skip_space(p, end);
+                if (p >= end || *p == '\n' || *p == '#') break;
+                std::array<int, 3> k = {0, 0, 0};
+                p = parse_index(p, end, v.size(), k[0]);
+                if (p < end && *p == '/') {
+                    p = parse_index(p + 1, end, vt.size(), k[1]);
+                    if (p < end && *p == '/') p = parse_index(p + 1, end, vn.size(), k[2]);
+                }
+                if (k[0] < 1 || k[0] > (int)v.size()) return false;
+                if (k[1] < 0 || k[2] < 0 || k[1] > (int)vt.size() || k[2] > (int)vn.size()) return false;
+                auto it = corners.find(k);
+                int index;
+                if (it != corners.end()) index = it->second;
+                else {
+                    index = mesh.positions.size();
+                    corners.emplace(k, index);
+                    mesh.positions.push_back(v[k[0] - 1]);
+                    mesh.uvs.push_back(k[1] ? vt[k[1] - 1] : Vec2f());
+                    mesh.normals.push_back(k[2] ? vn[k[2] - 1] : Vec3f());
+                }
+                polygon.push_back(index);
+            }
+            for (size_t i = 2; i < polygon.size(); i++) {
+                mesh.indices.push_back(polygon[0]);
+                mesh.indices.push_back(polygon[i-1]);
+                mesh.indices.push_back(polygon[i]);
+            }
+        }
+        p = next_line(p, end);
+    }
+    if (vt.empty()) mesh.uvs.clear();
+    if (vn.empty()) mesh.normals.clear();
+    else fill_missing_normals(mesh);
+    return true;
+}
+
+inline bool load_obj(const std::string &filename, ObjMesh &mesh) {
+    std::string data;
+    return read_file(filename, data) && parse_obj(data, mesh);
+}
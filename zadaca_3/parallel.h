@@ -0,0 +1,114 @@
+#pragma once
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+inline int thread_count() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Bazen od thread_count() - 1 dretvi koje zive do kraja programa. Posao je niz indeksa koje
+// pozivatelj i dretve bazena dohvacaju preko atomic brojaca; pozivatelj uvijek radi i sam, pa
+// posao zavrsava i kad su sve dretve zauzete (ugnijezdeni pozivi, vise pozivatelja odjednom,
+// fork-ani proces u kojem dretve bazena ne postoje).
+class ThreadPool {
+public:
+    static ThreadPool& instance() {
+        static ThreadPool pool(thread_count() - 1);
+        return pool;
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work.notify_all();
+        for (auto &t : workers) t.join();
+    }
+
+    // f(i, t) za i iz [0, n) na najvise threads dretvi; pozivatelj je t = 0. Iznimka iz f prekida
+    // program, kao i u dretvi bazena
+    template <typename F> void run(int n, int threads, F &f) noexcept {
+        Job job;
+        job.call = [](void *f, int i, int t) { (*static_cast<F*>(f))(i, t); };
+        job.f = &f;
+        job.n = n;
+        job.threads = threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(&job);
+        }
+        work.notify_all();
+        job.work(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+        finished.wait(lock, [&]() { return job.users == 0; });
+    }
+
+private:
+    struct Job {
+        void (*call)(void *f, int i, int t);
+        void *f;
+        int n, threads;
+        std::atomic<int> next{0};
+        int joined = 1, users = 0; // pod mutexom bazena
+        void work(int t) {
+            for (int i = next++; i < n; i = next++) call(f, i, t);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<Job*> jobs;
+    std::mutex mutex;
+    std::condition_variable work, finished;
+    bool stop = false;
+
+    explicit ThreadPool(int n) {
+        jobs.reserve(64);
+        for (int i = 0; i < n; i++) workers.emplace_back([this]() { loop(); });
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            Job *job = nullptr;
+            for (Job *j : jobs)
+                if (j->joined < j->threads && j->next < j->n) { job = j; break; }
+            if (!job) {
+                if (stop) return;
+                work.wait(lock);
+                continue;
+            }
+            int t = job->joined++;
+            job->users++;
+            lock.unlock();
+            job->work(t);
+            lock.lock();
+            if (--job->users == 0) finished.notify_all();
+        }
+    }
+};
+
+// poziva f(i, t) za i iz [0, n), t je indeks dretve iz [0, threads) (npr. za per-thread arene);
+// dretve iz bazena dohvacaju sljedeci indeks preko atomic brojaca pa je raspodjela dinamicka,
+// f mora biti neovisan o redoslijedu
+template <typename F> void parallel_for_indexed(int n, F f, int threads = thread_count()) {
+    threads = std::max(1, std::min(threads, n));
+    if (threads == 1) {
+        for (int i = 0; i < n; i++) f(i, 0);
+        return;
+    }
+    ThreadPool::instance().run(n, threads, f);
+}
+
+template <typename F> void parallel_for(int n, F f, int threads = thread_count()) {
+    parallel_for_indexed(n, [&](int i, int) { f(i); }, threads);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <limits>
+#include <algorithm>
+#include "geometry.h"
+
+struct Ray {
+    Vec3f orig, dir;
+    Vec3f inv_dir; // 1/dir, za nul-komponente ide u +-inf pa slab test radi bez grananja
+    int sign[3];   // 1 ako je komponenta smjera negativna, bira min ili max stranu kutije
+    Ray(const Vec3f& orig, const Vec3f& dir): orig(orig), dir(dir) {
+        for (int i = 0; i < 3; i++) {
+            inv_dir[i] = 1.f/dir[i];
+            sign[i] = inv_dir[i] < 0;
+        }
+    }
+};
+
+struct AABB {
+    Vec3f bounds[2]; // min, max
+    AABB() {
+        float m = std::numeric_limits<float>::max();
+        bounds[0] = Vec3f(m, m, m);
+        bounds[1] = -bounds[0];
+    }
+    AABB(const Vec3f& a, const Vec3f& b) {
+        bounds[0] = Vec3f(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+        bounds[1] = Vec3f(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+    }
+    void expand(const Vec3f& p) {
+        for (int i = 0; i < 3; i++) {
+            bounds[0][i] = std::min(bounds[0][i], p[i]);
+            bounds[1][i] = std::max(bounds[1][i], p[i]);
+        }
+    }
+    // po komponentama, pa prazna kutija ne mijenja rezultat
+    void expand(const AABB& b) {
+        for (int i = 0; i < 3; i++) {
+            bounds[0][i] = std::min(bounds[0][i], b.bounds[0][i]);
+            bounds[1][i] = std::max(bounds[1][i], b.bounds[1][i]);
+        }
+    }
+    bool empty() const { return bounds[0].x > bounds[1].x; }
+    Vec3f center() const { return (bounds[0] + bounds[1])*0.5f; }
+    // polovica oplosja, dovoljno za omjere u SAH-u
+    float half_area() const {
+        if (empty()) return 0;
+        Vec3f d = bounds[1] - bounds[0];
+        return d.x*d.y + d.y*d.z + d.z*d.x;
+    }
+    // slab test bez grananja, isti se koristi za objekte i za cvorove BVH-a
+    // max/min ignoriraju NaN u drugom argumentu (0*inf kad zraka lezi u ravnini plohe)
+    bool ray_intersect(const Ray& ray, float& tnear, float& tfar) const {
+        tnear = 0; tfar = std::numeric_limits<float>::max();
+        for (int i = 0; i < 3; i++) {
+            float t0 = (bounds[ray.sign[i]][i] - ray.orig[i]) * ray.inv_dir[i];
+            float t1 = (bounds[1 - ray.sign[i]][i] - ray.orig[i]) * ray.inv_dir[i];
+            tnear = std::max(tnear, t0);
+            tfar = std::min(tfar, t1);
+        }
+        return tnear <= tfar;
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include "geometry.h"
+
+// brzi hash (PCG), iz njega se izvode svi slucajni brojevi
+inline uint32_t pcg_hash(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline uint32_t hash_combine(uint32_t a, uint32_t b) {
+    return pcg_hash(a ^ (b + 0x9e3779b9u + (a << 6) + (a >> 2)));
+}
+
+// [0, 1) iz gornja 24 bita
+inline float uint_to_float(uint32_t v) {
+    return (v >> 8) * (1.f / 16777216.f);
+}
+
+// konkentricno preslikavanje kvadrata [-1, 1]^2 na jedinicni disk (Shirley-Chiu)
+inline Vec2f concentric_disk(float a, float b) {
+    const float pi4 = 0.78539816339744831f;
+    float r, phi;
+    if (a == 0 && b == 0) return Vec2f(0, 0);
+    if (std::abs(a) > std::abs(b)) { r = a; phi = pi4*(b/a); }
+    else { r = b; phi = 2*pi4 - pi4*(a/b); }
+    return Vec2f(r*std::cos(phi), r*std::sin(phi));
+}
+
+// Sampler za jedan uzorak jednog piksela. Stanje ovisi samo o (x, y, uzorak, seed),
+// pa rezultat ne ovisi o tome koja dretva i kojim redom racuna piksele.
+// Dimenzije se trose redom (next1D/next2D), svaka dobiva svoj Cranley-Patterson pomak
+// R2 niza (ili zlatnog reza za 1D), pa su uzorci jednog piksela niske diskrepancije.
+struct Sampler {
+    uint32_t pixel_seed;
+    uint32_t index;
+    uint32_t dim;
+
+    Sampler(int x, int y, int sample, uint32_t seed = 0) : index(sample), dim(0) {
+        pixel_seed = hash_combine(hash_combine(seed, x), y);
+    }
+
+    // obican hash RNG, kad niska diskrepancija nije potrebna
+    float random() {
+        return uint_to_float(hash_combine(hash_combine(pixel_seed, index), 0x80000000u | dim++));
+    }
+
+    float next1D() {
+        const double a = 0.6180339887498949; // 1/phi
+        float shift = uint_to_float(hash_combine(pixel_seed, dim++));
+        float v = (float)fmod(0.5 + a*index, 1.0) + shift;
+        return v < 1.f ? v : v - 1.f;
+    }
+
+    Vec2f next2D() {
+        const double a1 = 0.7548776662466927, a2 = 0.5698402909980532; // 1/g, 1/g^2, g = plasticni broj
+        uint32_t h = hash_combine(pixel_seed, dim++);
+        float sx = uint_to_float(h), sy = uint_to_float(pcg_hash(h));
+        float x = (float)fmod(0.5 + a1*index, 1.0) + sx;
+        float y = (float)fmod(0.5 + a2*index, 1.0) + sy;
+        return Vec2f(x < 1.f ? x : x - 1.f, y < 1.f ? y : y - 1.f);
+    }
+};